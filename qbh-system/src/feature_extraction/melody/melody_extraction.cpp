@@ -56,6 +56,8 @@ void usage (FILE * stream, int exit_code)
            "       -T      --smoothing-threshold   set smoothing threshold\n"
            "       -w      --windowsize            set window size\n"
            "General options:\n"
+           "       -M      --metrics               time the stages, json or prometheus\n"
+           "       -O      --metrics-output        file the metrics are written to\n"
            "       -v      --verbose               be verbose\n"
            "       -h      --help                  display this message\n"
            );
@@ -73,7 +75,7 @@ void usage (FILE * stream, int exit_code)
  */
 void parse_args (int argc, char **argv)
 {
-  const char *options = "hvi:r:B:H:o:p:u:l:s:S:w:";
+  const char *options = "hvi:r:B:H:o:p:u:l:s:S:w:M:O:";
   int next_option;
   struct option long_options[] = {
     {"help",                  0, NULL, 'h'},
@@ -89,6 +91,8 @@ void parse_args (int argc, char **argv)
     {"silence",               1, NULL, 's'},
     {"smoothing",             1, NULL, 'S'},
     {"windowsize",            1, NULL, 'w'},
+    {"metrics",               1, NULL, 'M'},
+    {"metrics-output",        1, NULL, 'O'},
     {NULL,                    0, NULL, 0}
   };
   
@@ -138,6 +142,15 @@ void parse_args (int argc, char **argv)
       case 'w':
         window_size = atoi (optarg);
         break;
+      case 'M':
+        metrics = 1;
+        count_allocations = 1;
+        metrics_format = optarg;
+        check_metrics_format (metrics_format);
+        break;
+      case 'O':
+        metrics_output = optarg;
+        break;
       case '?':                // unknown options
         usage (stderr, 1);
         break;
@@ -209,6 +222,12 @@ int main(int argc, char **argv)
   
   // print the result
   print_notes (sink_uri, onsets, duration, notes);
+
+  if (metrics) {
+    FILE *m = open_metrics ();
+    print_metrics (m, run_metrics);
+    close_metrics (m);
+  }
   
   return 0;
 }
\ No newline at end of file
@@ -27,7 +27,9 @@
 #include <algorithm>
 #include <getopt.h>
 #include <unistd.h>
+#include <sys/stat.h>
 #include <aubio/aubio.h>
+#include "../../similarity_retrieval/metrics.h"
 
 #ifdef HAVE_DEBUG
 #define debug(...)                fprintf (stderr, format , **args)
@@ -410,8 +412,14 @@ void aubio_pitch (char_t *source, vector<double> &pitch, vector<double> &pitch_c
   
   // process to analize audio file
   do {
-    aubio_source_do (this_source, ibuf, &read);
-    aubio_pitch_do (o, ibuf, note);
+    {
+      StageTimer timer (STAGE_DECODE);
+      aubio_source_do (this_source, ibuf, &read);
+    }
+    {
+      StageTimer timer (STAGE_PITCH);
+      aubio_pitch_do (o, ibuf, note);
+    }
     
     // store features
     smpl_t n = fvec_get_sample (note, 0);
@@ -547,15 +555,22 @@ void aubio_notes (char_t *source, vector<double> &onsets, vector<double> &durati
   // process to analize audio file
   do {
     smpl_t new_pitch, curlevel;
-    aubio_source_do (this_source, ibuf, &read);
-    aubio_onset_do (o, ibuf, onset);
-    aubio_pitch_do (p, ibuf, note);
+    {
+      StageTimer timer (STAGE_DECODE);
+      aubio_source_do (this_source, ibuf, &read);
+    }
+    {
+      StageTimer timer (STAGE_PITCH);
+      aubio_onset_do (o, ibuf, onset);
+      aubio_pitch_do (p, ibuf, note);
+    }
     
     // get note frecuency
     note_buffer.push_back (fvec_get_sample (note, 0));
     
     smpl_t os = fvec_get_sample(onset, 0);
     if (os && blocks > 0) {
+      StageTimer timer (STAGE_NOTES);
       duration.push_back ((blocks * hop_size / (float) samplerate) - (onsets.size() ? onsets.back() : 0));
       int n = get_note(note_buffer);
       notes.push_back ((n != 0 && last_note && abs (last_note - n) > 20) ? 0 : n);
@@ -569,8 +584,13 @@ void aubio_notes (char_t *source, vector<double> &onsets, vector<double> &durati
   } while (read == hop_size);
   
   // last note
-  duration.push_back ((blocks * hop_size / (float) samplerate) - (onsets.size() ? onsets.back() : 0));
-  notes.push_back (get_note(note_buffer));
+  {
+    StageTimer timer (STAGE_NOTES);
+    duration.push_back ((blocks * hop_size / (float) samplerate) - (onsets.size() ? onsets.back() : 0));
+    notes.push_back (get_note(note_buffer));
+  }
+  struct stat st;
+  if (metrics && stat (source, &st) == 0) metric_add (run_metrics.bytes, st.st_size);
   
   // clean all aubio objects
   del_fvec (note);
@@ -592,6 +612,7 @@ void aubio_notes (char_t *source, vector<double> &onsets, vector<double> &durati
  */
 void print_notes (char_t *source, vector<double> onsets, vector<double> duration, vector<int> notes)
 {
+  StageTimer timer (STAGE_OUTPUT);
   FILE *pFile = stdout;
   if (sink_uri != NULL) pFile = fopen (sink_uri, "w");
   
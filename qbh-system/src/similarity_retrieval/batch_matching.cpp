@@ -0,0 +1,328 @@
+/*
+ Copyright (C) 2013-2014 Jose Alemany Bordera <joalbor1@inf.upv.es>
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "utils.h"
+#include "corpus.h"
+#include "segments.h"
+
+
+char * batch_manifest = NULL;
+// queries matched together against each tile
+int group_size = 8;
+// size of the sequences of a tile
+long tile_size = 256 * 1024;
+
+struct BatchPool {
+  vector<Query> *queries;
+  Corpus *corpus;
+  vector<int> *bounds;
+  int next;                    // first query of the next group
+  pthread_mutex_t lock;
+};
+
+struct BatchWorker {
+  pthread_t thread;
+  BatchPool *pool;
+  Scratch sc;
+};
+
+
+/* Functions */
+
+/**
+ * @brief Shows how the program is used.
+ *
+ * Shows how the program is used and the allowed options.
+ * After running, the program finishes execution.
+ *
+ * @param stream Pointer to a FILE object that identifies an output stream.
+ * @param exit_code Status code.
+ *                  If this is 0 or EXIT_SUCCESS, it indicates success.
+ *                  If it is EXIT_FAILURE, it indicates failure.
+ */
+void usage (FILE * stream, int exit_code)
+{
+  fprintf (stream, "usage: %s manifest [ options ] \n", prog_name);
+  fprintf (stream,
+           "       -i      --input-database   xml file database\n"
+           "       -b      --binary-database  binary corpus file built by build_corpus\n"
+           "       -u      --segments         segment manifest written by update_corpus\n"
+           "       -m      --matching         select matching melody algorithm\n"
+           "       -r      --rank-size        number of songs in each rank\n"
+           "       -j      --threads          number of threads matching query groups\n"
+           "       -g      --group            queries matched together against each tile\n"
+           "       -k      --tile-kb          kilobytes of reference sequences per tile\n"
+           "       -p      --prune            skip songs that cannot reach the rank, in practice only with cdtw\n"
+           "       -x      --simd             use the vectorized kernels\n"
+           "       -w      --band             slack in notes of the cdtw band, a constraint, not a speedup\n"
+           "       -f      --paa              notes averaged by the first cascade step\n"
+           "       -H      --hits             non-overlapping matches of a song per reference\n"
+           "       -v      --verbose          be verbose\n"
+           "       -h      --help             display this message\n"
+           "\n"
+           "Each line of the manifest holds a humming file and the rank file to write.\n"
+           );
+  exit (exit_code);
+}
+
+/**
+ * @brief Parses command line arguments.
+ *
+ * Parses command line arguments and detects misuse.
+ *
+ * @param argc Number of arguments received by command line.
+ * @param argv Arguments received by command line.
+ */
+int parse_args (int argc, char **argv)
+{
+  const char *options = "hvi:b:m:r:j:g:k:pxw:f:u:H:";
+  int next_option;
+  struct option long_options[] = {
+    {"help",                  0, NULL, 'h'},
+    {"verbose",               0, NULL, 'v'},
+    {"input-database",        1, NULL, 'i'},
+    {"binary-database",       1, NULL, 'b'},
+    {"segments",              1, NULL, 'u'},
+    {"matching",              1, NULL, 'm'},
+    {"rank-size",             1, NULL, 'r'},
+    {"threads",               1, NULL, 'j'},
+    {"group",                 1, NULL, 'g'},
+    {"tile-kb",               1, NULL, 'k'},
+    {"prune",                 0, NULL, 'p'},
+    {"simd",                  0, NULL, 'x'},
+    {"band",                  1, NULL, 'w'},
+    {"paa",                   1, NULL, 'f'},
+    {"hits",                  1, NULL, 'H'},
+    {NULL,                    0, NULL, 0}
+  };
+
+  prog_name = argv[0];
+
+  // if required parameters are not received
+  if (argc < 2) {
+    usage (stderr, 1);
+    return -1;
+  }
+
+  batch_manifest = argv[1];
+
+  do {
+    next_option = getopt_long (argc, argv, options, long_options, NULL);
+    switch (next_option) {
+      case 'h':                // help
+        usage (stdout, 0);
+        return -1;
+      case 'v':                // verbose
+        verbose = 1;
+        break;
+      case 'i':
+        db_input = optarg;
+        break;
+      case 'b':
+        db_binary = optarg;
+        break;
+      case 'u':
+        db_segments = optarg;
+        break;
+      case 'm':
+        matching_method = optarg;
+        break;
+      case 'r':
+        rank_size = atoi (optarg);
+        break;
+      case 'j':
+        n_threads = atoi (optarg);
+        break;
+      case 'g':
+        group_size = atoi (optarg);
+        break;
+      case 'k':
+        tile_size = atol (optarg) * 1024;
+        break;
+      case 'p':
+        prune = 1;
+        break;
+      case 'x':
+        simd = 1;
+        break;
+      case 'w':
+        band = atoi (optarg);
+        break;
+      case 'f':
+        paa = atoi (optarg);
+        break;
+      case 'H':
+        max_hits = atoi (optarg);
+        break;
+      case '?':                // unknown options
+        usage (stderr, 1);
+        break;
+      case -1:                 // done with options
+        break;
+      default:                 // something else unexpected
+        fprintf (stderr, "Error parsing option '%c'\n", next_option);
+        abort ();
+    }
+  } while (next_option != -1);
+
+  if (find_method (matching_method) == NULL) {
+    errmsg ("Error: unknown matching method %s.\n", matching_method);
+    exit (1);
+  }
+  if (rank_size < 1 || group_size < 1 || tile_size < 1 || paa < 1 || max_hits < 1) {
+    errmsg ("Error: rank, group, tile, paa and hits sizes must be positive.\n");
+    exit (1);
+  }
+
+  return 0;
+}
+
+/**
+ * @brief Reads the manifest and the humming files it lists.
+ *
+ * Lines that are empty or start with '#' are skipped. A humming file that
+ * cannot be read is reported and left out of the batch.
+ *
+ * @param manifest Path of the manifest file.
+ * @param queries Vector where the queries are stored.
+ * @return Number of queries left out.
+ */
+int read_manifest (const char *manifest, vector<Query> &queries)
+{
+  FILE *in = fopen (manifest, "r");
+  if (in == NULL) {
+    errmsg ("Error: could not open manifest '%s'\n", manifest);
+    exit (1);
+  }
+
+  char line[2 * PATH_MAX + 2], input[PATH_MAX + 1], output[PATH_MAX + 1];
+  int failed = 0;
+  while (fgets (line, sizeof (line), in) != NULL) {
+    if (line[0] == '#' || sscanf (line, "%s", input) != 1) continue;
+    if (sscanf (line, "%s %s", input, output) != 2) {
+      errmsg ("Error: no rank file for humming input file '%s'\n", input);
+      failed++;
+      continue;
+    }
+    if (access (input, R_OK) != 0) {
+      errmsg ("Error: could not open humming input file '%s'\n", input);
+      failed++;
+      continue;
+    }
+    queries.push_back (Query ());
+    Query &q = queries.back ();
+    q.input = input;
+    q.output = output;
+    read_stream (input, q.seq);
+    if (q.seq.empty ()) {
+      errmsg ("Error: humming input file '%s' has no notes\n", input);
+      queries.pop_back ();
+      failed++;
+    }
+  }
+  fclose (in);
+  return failed;
+}
+
+void *batch_worker (void *arg)
+{
+  BatchWorker *w = (BatchWorker *) arg;
+  BatchPool *pool = w->pool;
+  int n_queries = pool->queries->size ();
+
+  for (;;) {
+    pthread_mutex_lock (&pool->lock);
+    int first = pool->next;
+    pool->next += group_size;
+    pthread_mutex_unlock (&pool->lock);
+    if (first >= n_queries) break;
+
+    int n = min (group_size, n_queries - first);
+    match_tiles (&(*pool->queries)[first], n, *pool->corpus, *pool->bounds, w->sc);
+  }
+  return NULL;
+}
+
+
+/* Main program */
+
+int main(int argc, char **argv)
+{
+  // variables
+  vector<Query> queries;
+  vector<int> bounds;
+  Corpus corpus;
+  int failed = 0;
+
+
+  // parse command line arguments
+  parse_args (argc, argv);
+
+  // read db.xml file and every song sequence, or the live segments, once
+  if (db_segments != NULL) {
+    Segments m;
+    read_segments (db_segments, m, false);
+    load_segments (m, corpus);
+  } else {
+    if (db_binary != NULL) map_corpus (db_binary, corpus);
+    load_corpus (db_input, corpus);
+  }
+  corpus_tiles (corpus, tile_size, bounds);
+  verbmsg ("%lu songs loaded, %lu tiles\n", corpus.songs.size (), bounds.size () - 1);
+
+  failed = read_manifest (batch_manifest, queries);
+
+  // match the query groups, one per thread at a time
+  double t = now ();
+  BatchPool pool;
+  pool.queries = &queries;
+  pool.corpus = &corpus;
+  pool.bounds = &bounds;
+  pool.next = 0;
+  pthread_mutex_init (&pool.lock, NULL);
+  vector<BatchWorker> workers (max (1, n_threads));
+  for (int k = 0; k < workers.size (); k++) {
+    workers[k].pool = &pool;
+    pthread_create (&workers[k].thread, NULL, batch_worker, &workers[k]);
+  }
+  for (int k = 0; k < workers.size (); k++)
+    pthread_join (workers[k].thread, NULL);
+  pthread_mutex_destroy (&pool.lock);
+  t = now () - t;
+
+  // save one rank per query
+  for (int k = 0; k < queries.size (); k++) {
+    FILE *out = fopen (queries[k].output.c_str (), "w");
+    if (out == NULL) {
+      errmsg ("Error: could not open rank output file '%s'\n", queries[k].output.c_str ());
+      failed++;
+      continue;
+    }
+    if (prune) {
+      verbmsg ("%s: ", queries[k].input.c_str ());
+      print_pruning (queries[k].pr);
+    }
+    save_rank (queries[k].rank, corpus, out);
+    fclose (out);
+  }
+
+  outmsg ("%lu queries in %.3f s, %.1f queries/s\n", queries.size (), t,
+          (t > 0) ? queries.size () / t : 0.0);
+
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,562 @@
+/*
+ Copyright (C) 2013-2014 Jose Alemany Bordera <joalbor1@inf.upv.es>
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+#include "utils.h"
+#include "corpus.h"
+#include "segments.h"
+#include <new>
+
+
+int query_size = 60;
+int reference_size = 1000;
+int n_references = 100;
+int n_queries = 20;
+// methods to measure, separated by commas
+const char * bench_methods = "dtw,cdtw,cascade,uds";
+char * json_output = NULL;
+char * baseline = NULL;
+// slowdown against the baseline reported as a regression, in percent
+double tolerance = 10;
+char * generate_dir = NULL;
+
+struct Result {
+  string method, kernel;
+  int queries;
+  double mcells, qps, p50, p99;
+  long allocs;
+};
+
+
+/* Functions */
+
+/**
+ * @brief Shows how the program is used.
+ *
+ * Shows how the program is used and the allowed options.
+ * After running, the program finishes execution.
+ *
+ * @param stream Pointer to a FILE object that identifies an output stream.
+ * @param exit_code Status code.
+ *                  If this is 0 or EXIT_SUCCESS, it indicates success.
+ *                  If it is EXIT_FAILURE, it indicates failure.
+ */
+void usage (FILE * stream, int exit_code)
+{
+  fprintf (stream, "usage: %s [ options ] \n", prog_name);
+  fprintf (stream,
+           "       -q      --query-size       notes of each synthetic humming\n"
+           "       -r      --reference-size   notes of each synthetic reference\n"
+           "       -c      --references       number of synthetic references\n"
+           "       -n      --queries          number of timed queries per method\n"
+           "       -m      --matching         methods to measure, separated by commas\n"
+           "       -j      --threads          number of threads scanning the corpus\n"
+           "       -o      --output           write the results as json to this file\n"
+           "       -B      --baseline         compare the results with this json file\n"
+           "       -T      --tolerance        slowdown in percent reported as a regression\n"
+           "       -g      --generate         write the corpus and queries as files to this directory\n"
+           "       -h      --help             display this message\n"
+           );
+  exit (exit_code);
+}
+
+/**
+ * @brief Parses command line arguments.
+ *
+ * Parses command line arguments and detects misuse.
+ *
+ * @param argc Number of arguments received by command line.
+ * @param argv Arguments received by command line.
+ */
+int parse_args (int argc, char **argv)
+{
+  const char *options = "hq:r:c:n:m:j:o:B:T:g:";
+  int next_option;
+  struct option long_options[] = {
+    {"help",                  0, NULL, 'h'},
+    {"query-size",            1, NULL, 'q'},
+    {"reference-size",        1, NULL, 'r'},
+    {"references",            1, NULL, 'c'},
+    {"queries",               1, NULL, 'n'},
+    {"matching",              1, NULL, 'm'},
+    {"threads",               1, NULL, 'j'},
+    {"output",                1, NULL, 'o'},
+    {"baseline",              1, NULL, 'B'},
+    {"tolerance",             1, NULL, 'T'},
+    {"generate",              1, NULL, 'g'},
+    {NULL,                    0, NULL, 0}
+  };
+
+  prog_name = argv[0];
+
+  do {
+    next_option = getopt_long (argc, argv, options, long_options, NULL);
+    switch (next_option) {
+      case 'h':                // help
+        usage (stdout, 0);
+        return -1;
+      case 'q':
+        query_size = atoi (optarg);
+        break;
+      case 'r':
+        reference_size = atoi (optarg);
+        break;
+      case 'c':
+        n_references = atoi (optarg);
+        break;
+      case 'n':
+        n_queries = atoi (optarg);
+        break;
+      case 'm':
+        bench_methods = optarg;
+        break;
+      case 'j':
+        n_threads = atoi (optarg);
+        break;
+      case 'o':
+        json_output = optarg;
+        break;
+      case 'B':
+        baseline = optarg;
+        break;
+      case 'T':
+        tolerance = atof (optarg);
+        break;
+      case 'g':
+        generate_dir = optarg;
+        break;
+      case '?':                // unknown options
+        usage (stderr, 1);
+        break;
+      case -1:                 // done with options
+        break;
+      default:                 // something else unexpected
+        fprintf (stderr, "Error parsing option '%c'\n", next_option);
+        abort ();
+    }
+  } while (next_option != -1);
+
+  if (query_size < 2 || reference_size < query_size || n_references < 1 || n_queries < 1) {
+    errmsg ("Error: sizes must be positive and queries shorter than references.\n");
+    exit (1);
+  }
+
+  return 0;
+}
+
+/**
+ * @brief Splits the list of methods to measure.
+ *
+ * @param methods Vector where the method names are stored.
+ */
+void bench_method_list (vector<string> &methods)
+{
+  string list (bench_methods);
+  for (size_t first = 0; first <= list.size (); ) {
+    size_t comma = list.find (',', first);
+    if (comma == string::npos) comma = list.size ();
+    string m = list.substr (first, comma - first);
+    if (m == "default") m = "dtw";
+    if (m != "dtw" && m != "cdtw" && m != "cascade" && m != "uds") {
+      errmsg ("Error: unknown matching method %s.\n", m.c_str ());
+      exit (1);
+    }
+    methods.push_back (m);
+    first = comma + 1;
+  }
+}
+
+/**
+ * @brief Generates a synthetic melody.
+ *
+ * Random walk of MIDI notes in the range of a singing voice.
+ *
+ * @param size Number of notes.
+ * @param seq Vector where the notes are stored.
+ */
+void synthetic_melody (int size, vector<int> &seq)
+{
+  int note = 60;
+  seq.clear ();
+  for (int i = 0; i < size; i++) {
+    note += rand () % 7 - 3;
+    if (note < 40) note = 40;
+    if (note > 80) note = 80;
+    seq.push_back (note);
+  }
+}
+
+/**
+ * @brief Generates a synthetic humming of a reference.
+ *
+ * An excerpt of the reference sung in another key, with one note in ten
+ * out of tune by a semitone.
+ *
+ * @param ref MIDI notes of the reference.
+ * @param size Number of notes.
+ * @param seq Vector where the notes are stored.
+ */
+void synthetic_humming (const int *ref, int ref_size, int size, vector<int> &seq)
+{
+  int first = rand () % (ref_size - size + 1);
+  int key = rand () % 11 - 5;
+  seq.clear ();
+  for (int i = 0; i < size; i++) {
+    int note = ref[first + i] + key;
+    if (rand () % 10 == 0) note += (rand () % 2) ? 1 : -1;
+    seq.push_back (note);
+  }
+}
+
+/**
+ * @brief Converts MIDI notes to UDS, with random durations.
+ */
+void synthetic_uds (const vector<int> &notes, vector<int> &seq)
+{
+  seq.clear ();
+  for (int i = 1; i < notes.size (); i++) {
+    seq.push_back ((notes[i-1] > notes[i]) ? 'D' : ((notes[i-1] < notes[i]) ? 'U' : 'S'));
+    seq.push_back ("SLE"[rand () % 3]);
+  }
+}
+
+void add_sequence (Corpus &corpus, Song &song, const vector<int> &seq)
+{
+  Sample sample;
+  sample.path = song.url;
+  sample.seq = corpus.pool.size ();
+  sample.size = seq.size ();
+  song.samples.push_back (sample);
+  corpus.pool.insert (corpus.pool.end (), seq.begin (), seq.end ());
+}
+
+/**
+ * @brief Writes MIDI notes as a note file, like the melody extraction does.
+ */
+void save_notes (const string &path, const vector<int> &notes)
+{
+  FILE *out = fopen (path.c_str (), "w");
+  if (out == NULL) {
+    errmsg ("Error: could not open note file '%s'\n", path.c_str ());
+    exit (1);
+  }
+  double onset = 0;
+  for (int i = 0; i < notes.size (); i++) {
+    double duration = 0.2 + (rand () % 60) / 100.0;
+    fprintf (out, "%lf\t%lf\t%d\n", onset, duration, notes[i]);
+    onset += duration;
+  }
+  fclose (out);
+}
+
+/**
+ * @brief Writes a synthetic corpus and its queries as files.
+ *
+ * The database is dir/db.xml, with db_root dir/, and the hummings are in
+ * dir/queries. build_corpus and the matching programs can then be run on
+ * them like on the real database.
+ *
+ * @param dir Output directory.
+ */
+void generate_files (const char *dir)
+{
+  string root = string (dir) + "/";
+  Corpus corpus;
+  vector<int> ref, seq;
+  vector<int> firsts;
+
+  mkdir (dir, 0755);
+  mkdir ((root + "refs").c_str (), 0755);
+  mkdir ((root + "queries").c_str (), 0755);
+  for (int k = 0; k < n_references; k++) {
+    char name[64];
+    // a thousand references per directory
+    sprintf (name, "refs/%d", k / 1000);
+    if (k % 1000 == 0) mkdir ((root + name).c_str (), 0755);
+    sprintf (name, "refs/%d/%d", k / 1000, k);
+    synthetic_melody (reference_size, ref);
+    save_notes (root + name, ref);
+    // the query excerpt is taken now, so references need not be kept
+    if (k < n_queries) {
+      synthetic_humming (&ref[0], ref.size (), query_size, seq);
+      char query[64];
+      sprintf (query, "queries/q%d", k);
+      save_notes (root + query, seq);
+    }
+
+    Song song;
+    Sample sample;
+    char title[64];
+    song.id = k + 1;
+    song.order = k;
+    sprintf (title, "Synthetic song %d", k + 1);
+    song.author = intern (corpus, "Synthetic");
+    song.title = intern (corpus, title);
+    song.genre = intern (corpus, "Synthetic");
+    // tinyxml2 reads an empty element as no text at all
+    song.url = intern (corpus, "-");
+    sprintf (name, "refs/%d/%d", k / 1000, k);
+    sample.path = intern (corpus, name);
+    song.samples.push_back (sample);
+    corpus.songs.push_back (song);
+  }
+  seal_strings (corpus);
+  save_database ((root + "db.xml").c_str (), corpus);
+  outmsg ("%d references of %d notes and %d queries of %d notes written to '%s'\n",
+          n_references, reference_size, min (n_queries, n_references), query_size, dir);
+}
+
+/**
+ * @brief Times the queries of a method against the corpus.
+ *
+ * A first query grows the scratch buffers and is not timed. Only the
+ * allocations done while matching are counted.
+ *
+ * @param method Matching method.
+ * @param kernel "scalar" or "simd".
+ * @param queries Hummings converted with the method.
+ * @param corpus Synthetic corpus converted with the method.
+ * @param ranks Rank list of each query.
+ * @return The measures of the method.
+ */
+Result run (const string &method, const char *kernel, vector<vector<int> > &queries,
+            Corpus &corpus, vector<vector<pair<int,double> > > &ranks)
+{
+  matching_method = method.c_str ();
+  simd = (strcmp (kernel, "simd") == 0);
+  vector<pair<int,double> > rank;
+  vector<double> latency;
+  double cells = 0, total = 0;
+  long allocs = 0;
+
+  match_corpus (queries[0], corpus, rank);
+  ranks.resize (queries.size ());
+  for (int q = 0; q < queries.size (); q++) {
+    rank.clear ();
+    long a = run_metrics.allocations;
+    double t = now ();
+    match_corpus (queries[q], corpus, rank);
+    t = now () - t;
+    allocs += run_metrics.allocations - a;
+    latency.push_back (t);
+    total += t;
+    cells += (double) queries[q].size () * corpus.pool.size ();
+    ranks[q] = rank;
+  }
+  sort (latency.begin (), latency.end ());
+
+  Result r;
+  r.method = method;
+  r.kernel = kernel;
+  r.queries = queries.size ();
+  r.mcells = cells / total / 1e6;
+  r.qps = queries.size () / total;
+  r.p50 = percentile (latency, 0.5) * 1e3;
+  r.p99 = percentile (latency, 0.99) * 1e3;
+  r.allocs = allocs;
+  return r;
+}
+
+/**
+ * @brief Writes the results as json.
+ *
+ * Every result is on its own line, so that a baseline is easy to read back.
+ */
+void save_results (const char *path, vector<Result> &results)
+{
+  FILE *out = fopen (path, "w");
+  if (out == NULL) {
+    errmsg ("Error: could not open benchmark output file '%s'\n", path);
+    exit (1);
+  }
+  fprintf (out, "{\n");
+  fprintf (out, "  \"config\": {\"query_size\": %d, \"reference_size\": %d, \"references\": %d, "
+                "\"queries\": %d, \"threads\": %d, \"lanes\": %d},\n",
+           query_size, reference_size, n_references, n_queries, n_threads, SIMD_WIDTH);
+  fprintf (out, "  \"results\": [\n");
+  for (int k = 0; k < results.size (); k++) {
+    Result &r = results[k];
+    fprintf (out, "    {\"method\": \"%s\", \"kernel\": \"%s\", \"queries\": %d, \"mcells_per_s\": %.3f, "
+                  "\"queries_per_s\": %.3f, \"p50_ms\": %.3f, \"p99_ms\": %.3f, \"allocations\": %ld}%s\n",
+             r.method.c_str (), r.kernel.c_str (), r.queries, r.mcells, r.qps, r.p50, r.p99, r.allocs,
+             (k + 1 < results.size ()) ? "," : "");
+  }
+  fprintf (out, "  ]\n}\n");
+  if (fclose (out) != 0) {
+    errmsg ("Error: could not write benchmark output file '%s'\n", path);
+    exit (1);
+  }
+}
+
+/**
+ * @brief Compares the results with the ones of a baseline json file.
+ *
+ * A baseline measured on another configuration, or with another number of
+ * queries for a method, is not comparable and fails the comparison.
+ *
+ * @param path Baseline written by save_results.
+ * @param results Results of this run.
+ * @return Number of regressions, methods slower than the tolerance allows,
+ *         or -1 if the baseline is not comparable.
+ */
+int compare_baseline (const char *path, vector<Result> &results)
+{
+  FILE *in = fopen (path, "r");
+  if (in == NULL) {
+    errmsg ("Error: could not open baseline '%s'\n", path);
+    exit (1);
+  }
+
+  char line[1024], method[16], kernel[16];
+  int size_q, size_r, refs, queries, threads, lanes;
+  int regressions = 0;
+  bool config = false;
+  Result b;
+  while (fgets (line, sizeof (line), in) != NULL) {
+    if (sscanf (line, " \"config\": {\"query_size\": %d, \"reference_size\": %d, \"references\": %d, "
+                "\"queries\": %d, \"threads\": %d, \"lanes\": %d", &size_q, &size_r, &refs, &queries,
+                &threads, &lanes) == 6) {
+      if (size_q != query_size || size_r != reference_size || refs != n_references ||
+          queries != n_queries || threads != n_threads || lanes != SIMD_WIDTH) {
+        errmsg ("Error: baseline '%s' was measured with another configuration\n", path);
+        fclose (in);
+        return -1;
+      }
+      config = true;
+      continue;
+    }
+    if (sscanf (line, " {\"method\": \"%15[^\"]\", \"kernel\": \"%15[^\"]\", \"queries\": %d, "
+                "\"mcells_per_s\": %lf, \"queries_per_s\": %lf, \"p50_ms\": %lf, \"p99_ms\": %lf",
+                method, kernel, &b.queries, &b.mcells, &b.qps, &b.p50, &b.p99) != 7)
+      continue;
+    for (int k = 0; k < results.size (); k++) {
+      Result &r = results[k];
+      if (r.method != method || r.kernel != kernel) continue;
+      if (!config || r.queries != b.queries) {
+        errmsg ("Error: baseline '%s' did not run the %s %s kernel on the same queries\n", path,
+                method, kernel);
+        fclose (in);
+        return -1;
+      }
+      bool slower = r.mcells < b.mcells * (1 - tolerance / 100);
+      outmsg ("%-8s %-7s x%.2f throughput, p99 %.3f ms against %.3f ms%s\n", method, kernel,
+              r.mcells / b.mcells, r.p99, b.p99, slower ? "  REGRESSION" : "");
+      if (slower) regressions++;
+    }
+  }
+  fclose (in);
+  return regressions;
+}
+
+
+/* Main program */
+
+int main(int argc, char **argv)
+{
+  // variables
+  vector<string> methods;
+  vector<Result> results;
+  vector<vector<int> > midi_queries, uds_queries;
+  vector<vector<pair<int,double> > > scalar_ranks, simd_ranks;
+  Corpus midi, uds;
+  vector<int> ref, seq, useq;
+  int failed = 0;
+
+
+  // parse command line arguments
+  parse_args (argc, argv);
+  bench_method_list (methods);
+  count_allocations = 1;
+
+  srand (1);
+  if (generate_dir != NULL) {
+    generate_files (generate_dir);
+    return 0;
+  }
+
+  // only build the conversions some method needs
+  bool need_midi = false, need_uds = false;
+  for (int k = 0; k < methods.size (); k++) {
+    if (methods[k] == "uds") need_uds = true;
+    else need_midi = true;
+  }
+  // the synthetic songs have no metadata, every string is empty
+  seal_strings (midi);
+  seal_strings (uds);
+  for (int k = 0; k < n_references; k++) {
+    Song song;
+    song.id = k + 1;
+    song.order = k;
+    song.author = song.title = song.genre = song.url = 0;
+    synthetic_melody (reference_size, ref);
+    if (need_midi) {
+      midi.songs.push_back (song);
+      add_sequence (midi, midi.songs.back (), ref);
+    }
+    if (need_uds) {
+      synthetic_uds (ref, useq);
+      uds.songs.push_back (song);
+      add_sequence (uds, uds.songs.back (), useq);
+    }
+    // queries are hummings of the first references
+    if (k < n_queries) {
+      synthetic_humming (&ref[0], ref.size (), query_size, seq);
+      midi_queries.push_back (seq);
+      synthetic_uds (seq, useq);
+      uds_queries.push_back (useq);
+    }
+  }
+  midi.values = midi.pool.empty () ? NULL : &midi.pool[0];
+  uds.values = uds.pool.empty () ? NULL : &uds.pool[0];
+
+  outmsg ("%d queries of %d notes, %d references of %d notes, %d threads, %d lanes\n",
+          (int) midi_queries.size (), query_size, n_references, reference_size, n_threads, SIMD_WIDTH);
+  outmsg ("%-8s %-7s %12s %12s %10s %10s %12s\n", "method", "kernel", "Mcells/s", "queries/s",
+          "p50 ms", "p99 ms", "allocations");
+  for (int k = 0; k < methods.size (); k++) {
+    bool is_uds = (methods[k] == "uds");
+    vector<vector<int> > &queries = is_uds ? uds_queries : midi_queries;
+    Corpus &corpus = is_uds ? uds : midi;
+
+    results.push_back (run (methods[k], "scalar", queries, corpus, scalar_ranks));
+    // cdtw has no vectorized kernel
+    if (methods[k] != "cdtw") {
+      results.push_back (run (methods[k], "simd", queries, corpus, simd_ranks));
+      if (scalar_ranks != simd_ranks) {
+        errmsg ("Error: the %s kernels do not agree\n", methods[k].c_str ());
+        failed = 1;
+      }
+    }
+    for (int r = results.size () - ((methods[k] != "cdtw") ? 2 : 1); r < results.size (); r++)
+      outmsg ("%-8s %-7s %12.3f %12.3f %10.3f %10.3f %12ld\n", results[r].method.c_str (),
+              results[r].kernel.c_str (), results[r].mcells, results[r].qps, results[r].p50,
+              results[r].p99, results[r].allocs);
+  }
+
+  // a serial scan must not allocate once warmed up, the workers of a
+  // threaded one take their blocks in any order and may still grow buffers
+  for (int r = 0; n_threads <= 1 && r < results.size (); r++) {
+    if (results[r].allocs == 0) continue;
+    errmsg ("Error: the %s %s kernel allocated memory while matching\n", results[r].method.c_str (),
+            results[r].kernel.c_str ());
+    failed = 1;
+  }
+
+  if (json_output != NULL) save_results (json_output, results);
+  if (baseline != NULL && compare_baseline (baseline, results) != 0) failed = 1;
+
+  return failed;
+}
@@ -0,0 +1,160 @@
+/*
+ Copyright (C) 2013-2014 Jose Alemany Bordera <joalbor1@inf.upv.es>
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "utils.h"
+#include "corpus.h"
+#include "index.h"
+#include "lsh.h"
+
+
+char * db_output = NULL;
+
+
+/* Functions */
+
+/**
+ * @brief Shows how the program is used.
+ *
+ * Shows how the program is used and the allowed options.
+ * After running, the program finishes execution.
+ *
+ * @param stream Pointer to a FILE object that identifies an output stream.
+ * @param exit_code Status code.
+ *                  If this is 0 or EXIT_SUCCESS, it indicates success.
+ *                  If it is EXIT_FAILURE, it indicates failure.
+ */
+void usage (FILE * stream, int exit_code)
+{
+  fprintf (stream, "usage: %s input_database output_corpus [ options ] \n", prog_name);
+  fprintf (stream,
+           "       -r      --db-root          directory the sample paths are relative to\n"
+           "       -n      --index            also write the uds n-gram index to this file\n"
+           "       -g      --gram             length of the indexed n-grams\n"
+           "       -l      --lsh              also write the melodic window lsh tables to this file\n"
+           "       -v      --verbose          be verbose\n"
+           "       -h      --help             display this message\n"
+           );
+  exit (exit_code);
+}
+
+/**
+ * @brief Parses command line arguments.
+ *
+ * Parses command line arguments and detects misuse.
+ *
+ * @param argc Number of arguments received by command line.
+ * @param argv Arguments received by command line.
+ */
+int parse_args (int argc, char **argv)
+{
+  const char *options = "hvr:n:g:l:";
+  int next_option;
+  struct option long_options[] = {
+    {"help",                  0, NULL, 'h'},
+    {"verbose",               0, NULL, 'v'},
+    {"db-root",               1, NULL, 'r'},
+    {"index",                 1, NULL, 'n'},
+    {"gram",                  1, NULL, 'g'},
+    {"lsh",                   1, NULL, 'l'},
+    {NULL,                    0, NULL, 0}
+  };
+
+  prog_name = argv[0];
+
+  // if required parameters are not received
+  if (argc < 3) {
+    usage (stderr, 1);
+    return -1;
+  }
+
+  db_input = argv[1];
+  db_output = argv[2];
+
+  do {
+    next_option = getopt_long (argc, argv, options, long_options, NULL);
+    switch (next_option) {
+      case 'h':                // help
+        usage (stdout, 0);
+        return -1;
+      case 'v':                // verbose
+        verbose = 1;
+        break;
+      case 'r':
+        db_root = optarg;
+        break;
+      case 'n':
+        db_index = optarg;
+        break;
+      case 'g':
+        index_gram = atoi (optarg);
+        break;
+      case 'l':
+        db_lsh = optarg;
+        break;
+      case '?':                // unknown options
+        usage (stderr, 1);
+        break;
+      case -1:                 // done with options
+        break;
+      default:                 // something else unexpected
+        fprintf (stderr, "Error parsing option '%c'\n", next_option);
+        abort ();
+    }
+  } while (next_option != -1);
+
+  if (index_gram < 1 || index_gram > 12) {
+    errmsg ("Error: n-grams must have from 1 to 12 symbols.\n");
+    exit (1);
+  }
+
+  return 0;
+}
+
+
+/* Main program */
+
+int main(int argc, char **argv)
+{
+  // variables
+  Corpus midi, uds;
+
+
+  // parse command line arguments
+  parse_args (argc, argv);
+
+  // read every song sequence with both conversions
+  matching_method = "dtw";
+  load_corpus (db_input, midi);
+  matching_method = "uds";
+  load_corpus (db_input, uds);
+
+  save_corpus (db_output, midi, uds);
+  verbmsg ("%lu songs, %lu + %lu values written to '%s'\n", midi.songs.size (),
+           midi.pool.size (), uds.pool.size (), db_output);
+
+  if (db_index != NULL) {
+    save_index (db_index, uds, index_gram);
+    verbmsg ("%d-gram index written to '%s'\n", index_gram, db_index);
+  }
+  if (db_lsh != NULL) {
+    save_lsh (db_lsh, midi, lsh_window, lsh_tables, lsh_hashes, lsh_width);
+    verbmsg ("lsh tables written to '%s'\n", db_lsh);
+  }
+
+  return 0;
+}
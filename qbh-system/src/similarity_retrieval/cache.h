@@ -0,0 +1,142 @@
+/*
+ Copyright (C) 2013-2014 Jose Alemany Bordera <joalbor1@inf.upv.es>
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+ * LRU cache of the rank xml answered to each query.
+ *
+ * The key is the fingerprint of the converted query: the UDS string, or the
+ * MIDI sequence minus its first note. Every DTW method only looks at the
+ * pitches relative to the first note of the query, so a query sung in
+ * another key gets exactly the same rank. The notes are already quantized
+ * to semitones by the conversion.
+ *
+ * The cache is emptied whenever the files the corpus was loaded from change.
+ */
+#include <list>
+#include <map>
+#include <string>
+#include <sys/stat.h>
+
+// cached ranks, 0 disables the cache
+int cache_size = 0;
+
+struct CacheEntry {
+  string key;
+  string rank;
+};
+
+struct RankCache {
+  list<CacheEntry> lru;        // most recently used first
+  map<string, list<CacheEntry>::iterator> entries;
+  string stamp;                // stamp of the corpus files of the entries
+  long hits, misses;
+  RankCache () : hits(0), misses(0) {}
+};
+
+
+/* Functions */
+
+/**
+ * @brief Fingerprint of a converted query.
+ *
+ * @param seq Humming sequence converted with the current matching method.
+ */
+string query_fingerprint (const vector<int> &seq)
+{
+  string key (matching_method);
+  bool midi = (strcmp (matching_method, "uds") != 0);
+
+  key.push_back ('\0');
+  for (int i = 0; i < seq.size (); i++) {
+    int v = midi ? seq[i] - seq[0] : seq[i];
+    key.append ((const char *) &v, sizeof (v));
+  }
+  return key;
+}
+
+/**
+ * @brief Identifies the current version of some files.
+ *
+ * Files replaced by rename or rewritten give a different stamp.
+ *
+ * @param paths Paths of the files, NULL ones are skipped.
+ * @param n Number of paths.
+ */
+string file_stamp (const char **paths, int n)
+{
+  string stamp;
+  for (int k = 0; k < n; k++) {
+    struct stat st;
+    char buf[128];
+    if (paths[k] == NULL) continue;
+    if (stat (paths[k], &st) != 0) {
+      stamp += "-;";
+      continue;
+    }
+    sprintf (buf, "%lu.%lu.%ld.%ld.%ld;", (unsigned long) st.st_dev, (unsigned long) st.st_ino,
+             (long) st.st_size, (long) st.st_mtim.tv_sec, (long) st.st_mtim.tv_nsec);
+    stamp += buf;
+  }
+  return stamp;
+}
+
+void cache_clear (RankCache &cache)
+{
+  cache.lru.clear ();
+  cache.entries.clear ();
+}
+
+/**
+ * @brief Looks a query up in the cache.
+ *
+ * @param cache Rank cache.
+ * @param key Fingerprint of the query.
+ * @param rank String where the cached rank xml is stored.
+ * @return Whether the query was cached.
+ */
+bool cache_find (RankCache &cache, const string &key, string &rank)
+{
+  map<string, list<CacheEntry>::iterator>::iterator it = cache.entries.find (key);
+  if (it == cache.entries.end ()) {
+    cache.misses++;
+    return false;
+  }
+  cache.hits++;
+  cache.lru.splice (cache.lru.begin (), cache.lru, it->second);
+  rank = it->second->rank;
+  return true;
+}
+
+/**
+ * @brief Adds the rank of a query to the cache.
+ *
+ * The least recently used rank is dropped when the cache is full.
+ */
+void cache_add (RankCache &cache, const string &key, const string &rank)
+{
+  if (cache_size < 1 || cache.entries.count (key) > 0) return;
+  if (cache.entries.size () >= cache_size) {
+    cache.entries.erase (cache.lru.back ().key);
+    cache.lru.pop_back ();
+  }
+  CacheEntry e;
+  e.key = key;
+  e.rank = rank;
+  cache.lru.push_front (e);
+  cache.entries[key] = cache.lru.begin ();
+}
@@ -0,0 +1,407 @@
+/*
+ Copyright (C) 2013-2014 Jose Alemany Bordera <joalbor1@inf.upv.es>
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+ * Scatter-gather coordinator of a sharded corpus.
+ *
+ * Every shard is a matching_server started with --shard k/n, so it only
+ * loads the songs whose id % n is k. The coordinator listens on its own
+ * socket with the same protocol as the engine, sends each query to every
+ * shard and merges their ranks. The shards hold different songs, so the
+ * best rank_size songs of the union are the rank of the whole corpus.
+ */
+
+#include "utils.h"
+#include "corpus.h"
+#include "server.h"
+#include <sys/prctl.h>
+#include <sys/wait.h>
+
+// shards started by the coordinator, 0 to use running ones
+int spawn_shards = 0;
+char * shard_program = NULL;
+
+struct RankEntry {
+  string author, title, genre, url;
+  double similarity;
+  long order;                  // position of the song in the corpus
+};
+
+// coverage of the shard ranks, for shards with a deadline
+struct Coverage {
+  bool known, partial;
+  int visited, songs;
+};
+
+
+/* Functions */
+
+/**
+ * @brief Shows how the program is used.
+ *
+ * Shows how the program is used and the allowed options.
+ * After running, the program finishes execution.
+ *
+ * @param stream Pointer to a FILE object that identifies an output stream.
+ * @param exit_code Status code.
+ *                  If this is 0 or EXIT_SUCCESS, it indicates success.
+ *                  If it is EXIT_FAILURE, it indicates failure.
+ */
+void usage (FILE * stream, int exit_code)
+{
+  fprintf (stream, "usage: %s socket [ options ] shard_socket ...\n", prog_name);
+  fprintf (stream, "       %s socket -n shards [ options ] -- [ matching_server options ]\n", prog_name);
+  fprintf (stream,
+           "       -n      --shards           start this many local shards on socket.0, socket.1...\n"
+           "       -e      --engine           matching_server program of the local shards\n"
+           "       -r      --rank-size        number of songs in the rank, also given to the local shards\n"
+           "       -v      --verbose          be verbose\n"
+           "       -h      --help             display this message\n"
+           "\n"
+           "Shards started apart must rank at least as many songs as the coordinator.\n"
+           );
+  exit (exit_code);
+}
+
+/**
+ * @brief Parses command line arguments.
+ *
+ * Parses command line arguments and detects misuse.
+ *
+ * @param argc Number of arguments received by command line.
+ * @param argv Arguments received by command line.
+ */
+int parse_args (int argc, char **argv)
+{
+  const char *options = "hvn:e:r:";
+  int next_option;
+  struct option long_options[] = {
+    {"help",                  0, NULL, 'h'},
+    {"verbose",               0, NULL, 'v'},
+    {"shards",                1, NULL, 'n'},
+    {"engine",                1, NULL, 'e'},
+    {"rank-size",             1, NULL, 'r'},
+    {NULL,                    0, NULL, 0}
+  };
+
+  prog_name = argv[0];
+
+  // if required parameters are not received
+  if (argc < 2) {
+    usage (stderr, 1);
+    return -1;
+  }
+
+  server_socket = argv[1];
+
+  do {
+    next_option = getopt_long (argc, argv, options, long_options, NULL);
+    switch (next_option) {
+      case 'h':                // help
+        usage (stdout, 0);
+        return -1;
+      case 'v':                // verbose
+        verbose = 1;
+        break;
+      case 'n':
+        spawn_shards = atoi (optarg);
+        break;
+      case 'e':
+        shard_program = optarg;
+        break;
+      case 'r':
+        rank_size = atoi (optarg);
+        break;
+      case '?':                // unknown options
+        usage (stderr, 1);
+        break;
+      case -1:                 // done with options
+        break;
+      default:                 // something else unexpected
+        fprintf (stderr, "Error parsing option '%c'\n", next_option);
+        abort ();
+    }
+  } while (next_option != -1);
+
+  if (rank_size < 1) {
+    errmsg ("Error: the rank must have at least one song.\n");
+    exit (1);
+  }
+  if (spawn_shards < 0) {
+    errmsg ("Error: the number of shards cannot be negative.\n");
+    exit (1);
+  }
+  // the socket is the first argument, not a shard
+  if (optind < argc && argv[optind] == server_socket) optind++;
+  if (spawn_shards == 0 && optind >= argc) {
+    errmsg ("Error: no shard sockets given.\n");
+    exit (1);
+  }
+
+  return 0;
+}
+
+/**
+ * @brief Starts the local shards.
+ *
+ * Shard k listens on socket.k and is killed when the coordinator dies.
+ * Every shard ranks as many songs as the coordinator, so that the merge
+ * is not short of songs. Waits until every shard has created its socket.
+ *
+ * @param n Number of shards.
+ * @param args matching_server options given to every shard.
+ * @param n_args Number of options.
+ * @param sockets Vector where the shard sockets are stored.
+ */
+void start_shards (int n, char **args, int n_args, vector<string> &sockets)
+{
+  string program;
+  if (shard_program != NULL) {
+    program = shard_program;
+  } else {
+    // matching_server lives next to the coordinator
+    program = prog_name;
+    size_t slash = program.rfind ('/');
+    program = (slash == string::npos) ? "matching_server" : program.substr (0, slash + 1) + "matching_server";
+  }
+
+  for (int k = 0; k < n; k++) {
+    char suffix[32], shard_arg[64], size_arg[32];
+    sprintf (suffix, ".%d", k);
+    sprintf (shard_arg, "%d/%d", k, n);
+    sprintf (size_arg, "%d", rank_size);
+    sockets.push_back (string (server_socket) + suffix);
+    unlink (sockets[k].c_str ());
+
+    vector<char *> argv;
+    argv.push_back ((char *) program.c_str ());
+    argv.push_back ((char *) sockets[k].c_str ());
+    argv.push_back ((char *) "--shard");
+    argv.push_back (shard_arg);
+    for (int i = 0; i < n_args; i++) argv.push_back (args[i]);
+    argv.push_back ((char *) "--rank-size");
+    argv.push_back (size_arg);
+    argv.push_back (NULL);
+
+    pid_t pid = fork ();
+    if (pid < 0) {
+      errmsg ("Error: could not start shard %d\n", k);
+      exit (1);
+    }
+    if (pid == 0) {
+      prctl (PR_SET_PDEATHSIG, SIGTERM);
+      execvp (argv[0], &argv[0]);
+      errmsg ("Error: could not run '%s'\n", argv[0]);
+      _exit (1);
+    }
+    verbmsg ("shard %d/%d started on '%s'\n", k, n, sockets[k].c_str ());
+  }
+
+  // a shard creates its socket once its part of the corpus is loaded
+  for (int k = 0; k < n; k++) {
+    struct stat st;
+    while (stat (sockets[k].c_str (), &st) != 0 || !S_ISSOCK (st.st_mode)) {
+      if (waitpid (-1, NULL, WNOHANG) > 0) {
+        errmsg ("Error: shard on '%s' exited before listening\n", sockets[k].c_str ());
+        exit (1);
+      }
+      usleep (10000);
+    }
+  }
+}
+
+/**
+ * @brief Sends a request line to a shard.
+ *
+ * @param path Path of the shard socket.
+ * @param request Request line ended by '\n'.
+ * @return The connection to read the answer from, or -1.
+ */
+int send_request (const char *path, const char *request)
+{
+  struct sockaddr_un addr;
+
+  int fd = socket (AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) return -1;
+  if (socket_address (path, addr) < 0 ||
+      connect (fd, (struct sockaddr *) &addr, sizeof (addr)) < 0 ||
+      write (fd, request, strlen (request)) != strlen (request)) {
+    errmsg ("Error: could not send query to shard '%s'\n", path);
+    close (fd);
+    return -1;
+  }
+  return fd;
+}
+
+const char *element_text (XMLElement *e, const char *name)
+{
+  XMLElement *child = e->FirstChildElement (name);
+  const char *text = (child != NULL) ? child->GetText () : NULL;
+  return (text != NULL) ? text : "";
+}
+
+/**
+ * @brief Reads the rank a shard answers and adds its songs to a list.
+ *
+ * @param fd Connection to the shard, closed on return.
+ * @param path Path of the shard socket.
+ * @param entries Vector where the songs are added.
+ * @param cov Coverage where the one of the shard is added.
+ * @return 0 on success, -1 if the shard gave no valid rank.
+ */
+int read_rank (int fd, const char *path, vector<RankEntry> &entries, Coverage &cov)
+{
+  string reply;
+  char buf[4096];
+  ssize_t n;
+
+  while ((n = read (fd, buf, sizeof (buf))) > 0)
+    reply.append (buf, n);
+  close (fd);
+
+  XMLDocument doc;
+  XMLElement *root;
+  if (reply.empty () || doc.Parse (reply.c_str (), reply.size ()) != XML_SUCCESS ||
+      (root = doc.FirstChildElement ("rank")) == NULL) {
+    errmsg ("Error: shard '%s' could not process the query\n", path);
+    return -1;
+  }
+  if (root->Attribute ("partial") != NULL) {
+    cov.known = true;
+    cov.partial = cov.partial || strcmp (root->Attribute ("partial"), "true") == 0;
+    cov.visited += atoi (root->Attribute ("visited") ? root->Attribute ("visited") : "0");
+    cov.songs += atoi (root->Attribute ("songs") ? root->Attribute ("songs") : "0");
+  }
+
+  for (XMLElement *song = root->FirstChildElement ("song"); song;
+       song = song->NextSiblingElement ("song")) {
+    RankEntry r;
+    r.author = element_text (song, "author");
+    r.title = element_text (song, "title");
+    r.genre = element_text (song, "genre");
+    r.url = element_text (song, "thumb_url");
+    r.similarity = strtod (element_text (song, "similarity"), NULL);
+    // shards that do not send the position of their songs are ranked last on ties
+    r.order = song->Attribute ("order") ? strtol (song->Attribute ("order"), NULL, 10) : LONG_MAX;
+    entries.push_back (r);
+  }
+  return 0;
+}
+
+bool better_entry (const RankEntry &r1, const RankEntry &r2)
+{
+  return r1.similarity < r2.similarity || (r1.similarity == r2.similarity && r1.order < r2.order);
+}
+
+/**
+ * @brief Writes the best rank_size songs of the shard ranks as xml.
+ *
+ * Every song is in one shard only and each shard rank already has unique
+ * songs, so the merged rank is unique too. Ties are ranked by the position
+ * of the songs in the corpus, as matching does, and then keep the order of
+ * the shards.
+ * If the shards ran with a deadline, the rank is partial when any of them is.
+ *
+ * @param entries Songs of the shard ranks.
+ * @param cov Coverage of the shard ranks.
+ * @param stream Pointer to a FILE object that identifies an output stream.
+ */
+void save_merged_rank (vector<RankEntry> &entries, Coverage &cov, FILE *stream)
+{
+  stable_sort (entries.begin (), entries.end (), better_entry);
+
+  vector<RankSong> songs;
+  for (int k = 0; k < entries.size () && k < rank_size; k++) {
+    RankEntry &r = entries[k];
+    RankSong song;
+    song.author = r.author.c_str ();
+    song.title = r.title.c_str ();
+    song.genre = r.genre.c_str ();
+    song.url = r.url.c_str ();
+    song.similarity = r.similarity;
+    song.order = -1;
+    songs.push_back (song);
+  }
+  string attributes;
+  if (cov.known) attributes = coverage_attributes (cov.partial, cov.visited, cov.songs);
+  print_rank (stream, songs, attributes.c_str ());
+}
+
+
+/* Main program */
+
+int main(int argc, char **argv)
+{
+  // variables
+  vector<string> sockets;
+  vector<int> fds;
+  vector<RankEntry> entries;
+  Coverage cov;
+  char request[PATH_MAX + 2];
+
+
+  // parse command line arguments
+  parse_args (argc, argv);
+
+  if (spawn_shards > 0) {
+    start_shards (spawn_shards, argv + optind, argc - optind, sockets);
+  } else {
+    for (int k = optind; k < argc; k++) sockets.push_back (argv[k]);
+  }
+  verbmsg ("%lu shards\n", sockets.size ());
+
+  int fd = listen_server (server_socket);
+
+  // loop for each query
+  for (;;) {
+    int client = accept (fd, NULL, NULL);
+    if (client < 0) continue;
+
+    if (read_request (client, request, sizeof (request) - 1) <= 0) {
+      close (client);
+      continue;
+    }
+    verbmsg ("query '%s'\n", request);
+    strcat (request, "\n");
+
+    // scatter the query first, so that the shards match it at the same time
+    int failed = 0;
+    fds.clear ();
+    for (int k = 0; k < sockets.size (); k++) {
+      fds.push_back (send_request (sockets[k].c_str (), request));
+      if (fds[k] < 0) failed++;
+    }
+
+    // gather the shard ranks
+    entries.clear ();
+    cov.known = cov.partial = false;
+    cov.visited = cov.songs = 0;
+    for (int k = 0; k < sockets.size (); k++)
+      if (fds[k] >= 0 && read_rank (fds[k], sockets[k].c_str (), entries, cov) < 0) failed++;
+
+    if (failed == 0) {
+      FILE *out = fdopen (client, "w");
+      save_merged_rank (entries, cov, out);
+      fclose (out);
+    } else {
+      close (client);
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,858 @@
+/*
+ Copyright (C) 2013-2014 Jose Alemany Bordera <joalbor1@inf.upv.es>
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <cerrno>
+#include <string>
+#include <map>
+#include <set>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+
+
+/* Corpus stuff */
+
+// root directory the sample paths of the database are relative to
+const char * db_root = "../../";
+// binary corpus with the converted sequences
+char * db_binary = NULL;
+// number of threads scanning the corpus
+int n_threads = 1;
+// part of the corpus loaded, the songs whose id % n_shards is shard
+int shard = 0, n_shards = 1;
+// pruning counters of the last query
+Pruning prune_stats;
+// time a scan may take in milliseconds, 0 for no limit
+double deadline_ms = 0;
+// songs visited by the last scan, fewer than the corpus when the deadline passed
+int scan_visited = 0;
+
+/*
+ * Binary corpus file, as written by build_corpus (native byte order):
+ *
+ *   CorpusHeader
+ *   CorpusSong   songs[n_songs]
+ *   CorpusSample samples[n_samples]
+ *   int          values[n_values]
+ *   char         chars[n_chars]
+ *
+ * Each sample points to its MIDI and UDS sequences inside values. The
+ * metadata of the songs and the sample paths, relative to db_root, are
+ * offsets of nul terminated strings inside chars, each string stored once.
+ * A mapped corpus needs nothing else, the xml database is not read.
+ */
+#define CORPUS_MAGIC "QBHCORP2"
+
+struct CorpusHeader {
+  char magic[8];
+  int n_songs, n_samples, n_values, n_chars;
+};
+
+struct CorpusSong {
+  int id;
+  int first_sample, n_samples;
+  int author, title, genre, url;
+};
+
+struct CorpusSample {
+  int midi, midi_size;
+  int uds, uds_size;
+  int path;
+};
+
+struct Sample {
+  int path;                    // path relative to db_root, inside the corpus strings
+  int seq, size;               // sequence position inside the corpus values
+};
+
+// metadata fields are positions inside the corpus strings
+struct Song {
+  int id;
+  long order;                  // position in the whole corpus, songs of other shards included
+  int author;
+  int title;
+  int genre;
+  int url;
+  vector<Sample> samples;
+};
+
+// song of a rank response
+struct RankSong {
+  const char *author, *title, *genre, *url;
+  double similarity;
+  long order;                  // position of the song in the corpus, -1 if not sent
+};
+
+struct Corpus {
+  vector<Song> songs;
+  const int *values;
+  const char *strings;         // metadata strings
+  size_t strings_size;
+  // sequences read from the text files
+  vector<int> pool;
+  // strings read from the xml database, and where each one is
+  vector<char> chars;
+  std::map<string, int> interned;
+  // sequences and strings of a mapped binary corpus
+  void *map;
+  size_t map_size;
+  Corpus () : values(NULL), strings(NULL), strings_size(0), map(NULL), map_size(0) {}
+};
+
+// part of a sample worth matching, [first, last) positions of the sequence
+struct Window {
+  int song, sample;
+  int first, last;
+};
+
+// when filtering, only these windows are matched, sorted by song and sample
+bool filter_windows = false;
+vector<Window> scan_windows;
+
+
+/* Functions */
+
+/**
+ * @brief Position of a string in the corpus strings.
+ *
+ * The string is added if it is not there yet. NULL is taken as empty, as
+ * tinyxml2 reads an empty element as no text at all.
+ */
+int intern (Corpus &corpus, const char *str)
+{
+  if (str == NULL) str = "";
+  map<string, int>::iterator it = corpus.interned.find (str);
+  if (it != corpus.interned.end ()) return it->second;
+  int pos = corpus.chars.size ();
+  corpus.chars.insert (corpus.chars.end (), str, str + strlen (str) + 1);
+  corpus.interned[str] = pos;
+  return pos;
+}
+
+/**
+ * @brief Makes the strings added by intern the corpus strings.
+ */
+void seal_strings (Corpus &corpus)
+{
+  if (corpus.chars.empty ()) intern (corpus, "");
+  corpus.strings = &corpus.chars[0];
+  corpus.strings_size = corpus.chars.size ();
+}
+
+const char *text (Corpus &corpus, int pos)
+{
+  return corpus.strings + pos;
+}
+
+/**
+ * @brief Maps a binary corpus file in memory.
+ *
+ * The sequences and the metadata are used in place, nothing is parsed.
+ * load_corpus must be called afterwards to take the songs of the shard.
+ *
+ * @param bin Path of the binary corpus file.
+ * @param corpus Corpus object where the file is mapped.
+ */
+void map_corpus (const char *bin, Corpus &corpus)
+{
+  struct stat st;
+  int fd = open (bin, O_RDONLY);
+  if (fd < 0 || fstat (fd, &st) < 0) {
+    errmsg ("Error: could not open binary corpus '%s'\n", bin);
+    exit (1);
+  }
+
+  void *map = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close (fd);
+  const CorpusHeader *h = (const CorpusHeader *) map;
+  if (map != MAP_FAILED && st.st_size >= sizeof (CorpusHeader) && memcmp (h->magic, "QBHCORP", 7) == 0 &&
+      memcmp (h->magic, CORPUS_MAGIC, sizeof (h->magic)) != 0) {
+    errmsg ("Error: binary corpus '%s' has an older format, build it again with build_corpus\n", bin);
+    exit (1);
+  }
+  if (map == MAP_FAILED || st.st_size < sizeof (CorpusHeader) ||
+      memcmp (h->magic, CORPUS_MAGIC, sizeof (h->magic)) != 0 ||
+      st.st_size != sizeof (CorpusHeader) + h->n_songs * sizeof (CorpusSong) +
+                    h->n_samples * sizeof (CorpusSample) + h->n_values * sizeof (int) + h->n_chars ||
+      h->n_chars < 1 || ((const char *) map)[st.st_size - 1] != '\0') {
+    errmsg ("Error: '%s' is not a valid binary corpus\n", bin);
+    exit (1);
+  }
+
+  corpus.map = map;
+  corpus.map_size = st.st_size;
+}
+
+/**
+ * @brief Loads the songs of a mapped binary corpus.
+ *
+ * Only the positions of the sequences and strings are copied.
+ */
+void load_binary (Corpus &corpus)
+{
+  const CorpusHeader *h = (const CorpusHeader *) corpus.map;
+  const CorpusSong *bin_songs = (const CorpusSong *) (h + 1);
+  const CorpusSample *bin_samples = (const CorpusSample *) (bin_songs + h->n_songs);
+  bool uds = (strcmp (matching_method, "uds") == 0);
+
+  corpus.values = (const int *) (bin_samples + h->n_samples);
+  corpus.strings = (const char *) (corpus.values + h->n_values);
+  corpus.strings_size = h->n_chars;
+  corpus.songs.reserve (h->n_songs / n_shards + 1);
+  for (int i = 0; i < h->n_songs; i++) {
+    const CorpusSong &bs = bin_songs[i];
+    if (bs.id % n_shards != shard) continue;
+    Song s;
+    s.id = bs.id;
+    s.order = i;
+    s.author = bs.author;
+    s.title = bs.title;
+    s.genre = bs.genre;
+    s.url = bs.url;
+    s.samples.resize (bs.n_samples);
+    for (int j = 0; j < bs.n_samples; j++) {
+      const CorpusSample &bsa = bin_samples[bs.first_sample + j];
+      s.samples[j].path = bsa.path;
+      s.samples[j].seq = uds ? bsa.uds : bsa.midi;
+      s.samples[j].size = uds ? bsa.uds_size : bsa.midi_size;
+    }
+    corpus.songs.push_back (s);
+  }
+}
+
+/**
+ * @brief Reads a song id.
+ *
+ * Ids are sparse non negative integers, anything else is rejected instead of
+ * being read as another id.
+ *
+ * @param text Id as written in the database or given by the user.
+ * @param id Where the id is stored.
+ * @return Whether the text is a valid id.
+ */
+bool parse_id (const char *text, int &id)
+{
+  if (text == NULL || *text < '0' || *text > '9') return false;
+  char *end;
+  errno = 0;
+  long v = strtol (text, &end, 10);
+  if (*end != '\0' || errno != 0 || v > INT_MAX) return false;
+  id = (int) v;
+  return true;
+}
+
+/**
+ * @brief Loads the whole database in memory.
+ *
+ * Reads the xml database and every reference sample it points to, converting
+ * each sample with the current matching method. The corpus can then be matched
+ * against any number of queries without touching the disk again.
+ * If a binary corpus has been mapped, the songs, their metadata and the
+ * sequences are all taken from it, and neither the xml database nor the
+ * reference files are read.
+ *
+ * @param db Path of the xml database file.
+ * @param corpus Corpus object where songs and converted samples are stored.
+ */
+void load_corpus (const char *db, Corpus &corpus)
+{
+  StageTimer timer (STAGE_LOAD);
+
+  corpus.songs.clear ();
+  corpus.pool.clear ();
+  corpus.chars.clear ();
+  corpus.interned.clear ();
+  if (corpus.map != NULL) {
+    load_binary (corpus);
+    return;
+  }
+
+  XMLDocument doc;
+  if (doc.LoadFile (db) != XML_SUCCESS || doc.RootElement () == NULL) {
+    errmsg ("Error: could not load database '%s'\n", db);
+    exit (1);
+  }
+  struct stat st;
+  if (metrics && stat (db, &st) == 0) metric_add (run_metrics.bytes, st.st_size);
+
+  XMLElement *song = doc.RootElement()->FirstChildElement("song");
+  set<int> ids;
+  // loop for each song
+  for (long order = 0; song != NULL; song = song->NextSiblingElement("song"), order++)
+  {
+    verbmsg ("%s %s\n", song->Name (), song->Attribute("id"));
+    XMLElement *sample = song->FirstChildElement("samples")->FirstChildElement("sample");
+    Song s;
+    if (!parse_id (song->Attribute("id"), s.id)) {
+      errmsg ("Error: song with bad id '%s' in database '%s'\n",
+              song->Attribute("id") ? song->Attribute("id") : "", db);
+      exit (1);
+    }
+    if (!ids.insert (s.id).second) {
+      errmsg ("Error: song id %d repeated in database '%s'\n", s.id, db);
+      exit (1);
+    }
+    if (s.id % n_shards != shard) continue;
+    s.order = order;
+    s.author = intern (corpus, song->FirstChildElement("author")->GetText());
+    s.title = intern (corpus, song->FirstChildElement("title")->GetText());
+    s.genre = intern (corpus, song->FirstChildElement("genre")->GetText());
+    s.url = intern (corpus, song->FirstChildElement("thumb_url")->GetText());
+    // loop for each sample
+    do
+    {
+      verbmsg ("%s %s\n", sample->Name (), sample->Attribute("path"));
+      string path = string (db_root) + sample->Attribute("path");
+
+      Sample sa;
+      sa.path = intern (corpus, sample->Attribute("path"));
+      // read song sequence
+      vector<int> seq;
+      StageTimer timer (STAGE_REFERENCES);
+      read_stream ((char *) path.c_str (), seq);
+      sa.seq = corpus.pool.size ();
+      sa.size = seq.size ();
+      corpus.pool.insert (corpus.pool.end (), seq.begin (), seq.end ());
+      s.samples.push_back (sa);
+    } while ((sample=sample->NextSiblingElement("sample")) != NULL);
+    corpus.songs.push_back (s);
+  }
+
+  corpus.values = corpus.pool.empty () ? NULL : &corpus.pool[0];
+  seal_strings (corpus);
+}
+
+/**
+ * @brief Writes a binary corpus file.
+ *
+ * Both corpus objects must have been loaded from the same database, the first
+ * one with the dtw method and the second one with the uds method.
+ *
+ * @param bin Path of the binary corpus file.
+ * @param midi Corpus with the MIDI sequences.
+ * @param uds Corpus with the UDS sequences.
+ */
+void save_corpus (const char *bin, Corpus &midi, Corpus &uds)
+{
+  CorpusHeader h;
+  vector<CorpusSong> songs;
+  vector<CorpusSample> samples;
+
+  for (int i = 0; i < midi.songs.size (); i++) {
+    CorpusSong cs;
+    cs.id = midi.songs[i].id;
+    cs.first_sample = samples.size ();
+    cs.n_samples = midi.songs[i].samples.size ();
+    cs.author = midi.songs[i].author;
+    cs.title = midi.songs[i].title;
+    cs.genre = midi.songs[i].genre;
+    cs.url = midi.songs[i].url;
+    songs.push_back (cs);
+    for (int j = 0; j < cs.n_samples; j++) {
+      CorpusSample csa;
+      csa.midi = midi.songs[i].samples[j].seq;
+      csa.midi_size = midi.songs[i].samples[j].size;
+      // UDS sequences are stored after all the MIDI ones
+      csa.uds = midi.pool.size () + uds.songs[i].samples[j].seq;
+      csa.uds_size = uds.songs[i].samples[j].size;
+      csa.path = midi.songs[i].samples[j].path;
+      samples.push_back (csa);
+    }
+  }
+
+  memcpy (h.magic, CORPUS_MAGIC, sizeof (h.magic));
+  h.n_songs = songs.size ();
+  h.n_samples = samples.size ();
+  h.n_values = midi.pool.size () + uds.pool.size ();
+  h.n_chars = midi.strings_size;
+
+  FILE *out = fopen (bin, "wb");
+  if (out == NULL) {
+    errmsg ("Error: could not open binary corpus output file '%s'\n", bin);
+    exit (1);
+  }
+  fwrite (&h, sizeof (h), 1, out);
+  fwrite (&songs[0], sizeof (CorpusSong), songs.size (), out);
+  fwrite (&samples[0], sizeof (CorpusSample), samples.size (), out);
+  fwrite (&midi.pool[0], sizeof (int), midi.pool.size (), out);
+  fwrite (&uds.pool[0], sizeof (int), uds.pool.size (), out);
+  fwrite (midi.strings, 1, midi.strings_size, out);
+  if (fclose (out) != 0) {
+    errmsg ("Error: could not write binary corpus '%s'\n", bin);
+    exit (1);
+  }
+}
+
+bool window_before (const Window &w, int song)
+{
+  return w.song < song;
+}
+
+/**
+ * @brief Matches a query against the windows of a range of songs.
+ *
+ * Same as match_songs, but only the parts of the samples left in scan_windows
+ * are matched. A sample may add one rank entry per window.
+ */
+void match_windows (const vector<int> &seq, Corpus &corpus, int first, int last, vector<pair<int,double> > &rank, Pruning *pr, Scratch &sc)
+{
+  const MatchingMethod *method = find_method (matching_method);
+  if (method == NULL) return;
+  vector<Window>::const_iterator w = lower_bound (scan_windows.begin (), scan_windows.end (), first, window_before);
+  long cells = 0, references = 0;
+  for (; w != scan_windows.end () && w->song < last; w++) {
+    Song &song = corpus.songs[w->song];
+    Sample &sa = song.samples[w->sample];
+    verbmsg ("'%s' [%d, %d) analizando...\n", text (corpus, sa.path), w->first, w->last);
+    int n = rank.size ();
+    method->match (seq, corpus.values + sa.seq + w->first, w->last - w->first, w->song, rank, pr, sc);
+    if (pr != NULL && rank.size () > n)
+      update_pruning (*pr, w->song, rank.back ().second);
+    verbmsg ("..fin de la cancion\n\n");
+    cells += (long) seq.size () * (w->last - w->first);
+    references++;
+  }
+  metric_add (run_metrics.cells, cells);
+  metric_add (run_metrics.references, references);
+}
+
+/**
+ * @brief Matches a query against a range of songs of the corpus.
+ *
+ * @param seq Converted humming sequence.
+ * @param corpus Corpus loaded by load_corpus.
+ * @param first Index of the first song.
+ * @param last Index past the last song.
+ * @param rank Rank list where the <song, similarity> pairs are stored.
+ * @param pr Pruning state, NULL to match every sample completely.
+ * @param sc Scratch buffers of the thread.
+ */
+void match_songs (const vector<int> &seq, Corpus &corpus, int first, int last, vector<pair<int,double> > &rank, Pruning *pr, Scratch &sc)
+{
+  if (filter_windows) {
+    match_windows (seq, corpus, first, last, rank, pr, sc);
+    return;
+  }
+  // the method is looked up once, not for every sample
+  const MatchingMethod *method = find_method (matching_method);
+  if (method == NULL) return;
+  long cells = 0, references = 0;
+  for (int i = first; i < last; i++) {
+    Song &song = corpus.songs[i];
+    for (int j = 0; j < song.samples.size (); j++) {
+      verbmsg ("'%s' analizando...\n", text (corpus, song.samples[j].path));
+      int n = rank.size ();
+      method->match (seq, corpus.values + song.samples[j].seq, song.samples[j].size, i, rank, pr, sc);
+      if (pr != NULL && rank.size () > n)
+        update_pruning (*pr, i, rank.back ().second);
+      verbmsg ("..fin de la cancion\n\n");
+      cells += (long) seq.size () * song.samples[j].size;
+    }
+    references += song.samples.size ();
+  }
+  metric_add (run_metrics.cells, cells);
+  metric_add (run_metrics.references, references);
+}
+
+/**
+ * @brief Adds the counters of a pruning state to another one.
+ */
+void add_pruning (Pruning &total, Pruning &pr)
+{
+  total.samples += pr.samples;
+  total.samples_pruned += pr.samples_pruned;
+  total.samples_abandoned += pr.samples_abandoned;
+  total.cells += pr.cells;
+  total.cells_pruned += pr.cells_pruned;
+}
+
+struct ScanPool {
+  const vector<int> *seq;
+  Corpus *corpus;
+  int block, n_blocks;
+  int next;                    // next block to scan
+  const vector<int> *order;    // songs to scan one per block, NULL for database order
+  double deadline;             // time no block is started after, 0 for none
+  pthread_mutex_t lock;
+  vector<int> owner, begin, end;    // where each block is in the partial ranks
+};
+
+struct ScanWorker {
+  pthread_t thread;
+  ScanPool *pool;
+  vector<pair<int,double> > rank;   // private partial rank
+  Pruning pr;                  // private pruning threshold
+  Scratch sc;                  // private scratch buffers
+  vector<int> blocks;          // blocks scanned, in order
+  vector<int> ends;            // end of each block inside rank
+};
+
+// buffers kept from one query to the next
+Scratch scratch;
+ScanPool scan_pool;
+vector<ScanWorker> scan_workers;
+vector<int> scan_songs;
+
+void *scan_worker (void *arg)
+{
+  ScanWorker *w = (ScanWorker *) arg;
+  ScanPool *pool = w->pool;
+
+  for (;;) {
+    if (pool->deadline > 0 && now () >= pool->deadline) break;
+    pthread_mutex_lock (&pool->lock);
+    int b = pool->next++;
+    pthread_mutex_unlock (&pool->lock);
+    if (b >= pool->n_blocks) break;
+
+    int first = b * pool->block;
+    int last = min (first + pool->block, (int) pool->corpus->songs.size ());
+    if (pool->order != NULL) {
+      first = (*pool->order)[b];
+      last = first + 1;
+    }
+    match_songs (*pool->seq, *pool->corpus, first, last, w->rank, prune ? &w->pr : NULL, w->sc);
+    w->blocks.push_back (b);
+    w->ends.push_back (w->rank.size ());
+  }
+  return NULL;
+}
+
+/**
+ * @brief Orders the songs of the corpus by how promising they are.
+ *
+ * The MIDI methods visit first the songs with the lowest pitch lower bound
+ * of any of their samples. UDS has no such bound and keeps database order.
+ * The bounds are computed against the deadline of the scan too: once it has
+ * passed, the songs left keep database order after the bounded ones.
+ *
+ * @param seq Converted humming sequence.
+ * @param corpus Corpus loaded by load_corpus.
+ * @param deadline Time the ordering stops at.
+ * @param order Vector where the song indexes are stored.
+ */
+void scan_order (const vector<int> &seq, Corpus &corpus, double deadline, vector<int> &order)
+{
+  vector<pair<int,int> > bounds (corpus.songs.size ());
+  bool midi = (strcmp (matching_method, "uds") != 0), late = false;
+
+  for (int i = 0; i < corpus.songs.size (); i++) {
+    Song &song = corpus.songs[i];
+    int lb = midi ? INT_MAX : 0;
+    // the clock is read every few songs only
+    if (midi && !late && i % 64 == 0) late = (now () >= deadline);
+    for (int j = 0; midi && !late && j < song.samples.size (); j++)
+      lb = min (lb, pitch_lower_bound (seq, corpus.values + song.samples[j].seq, song.samples[j].size));
+    bounds[i] = make_pair (lb, i);
+  }
+  sort (bounds.begin (), bounds.end ());
+
+  order.resize (bounds.size ());
+  for (int i = 0; i < bounds.size (); i++)
+    order[i] = bounds[i].second;
+}
+
+/**
+ * @brief Matches a query against every sample of the corpus.
+ *
+ * Appends to the rank list the similarity of each sample, in database order,
+ * exactly as the matching program does reading the references from disk.
+ * Songs are identified by their position in corpus.songs, whatever their ids.
+ * With more than one thread the songs are split in blocks scanned by a pool
+ * of workers, and their partial ranks are merged back in database order so
+ * the result does not depend on the number of threads.
+ * When pruning, each worker keeps its own threshold, which is never tighter
+ * than the global one, and the counters are added to prune_stats.
+ * The scratch buffers of the kernels are kept between queries, so once they
+ * have grown to the longest reference a serial scan does not allocate memory.
+ * With a deadline the songs are scanned one by one, the most promising ones
+ * first, and no song is started once it has passed. The rank is then the
+ * best one of the songs visited, and scan_visited tells how many they were.
+ *
+ * @param seq Converted humming sequence.
+ * @param corpus Corpus loaded by load_corpus.
+ * @param rank Rank list where the <song, similarity> pairs are stored.
+ */
+void match_corpus (const vector<int> &seq, Corpus &corpus, vector<pair<int,double> > &rank)
+{
+  StageTimer timer (STAGE_MATCH);
+  int n_songs = corpus.songs.size ();
+  double start = now ();
+  reset_pruning (prune_stats);
+  scan_visited = n_songs;
+  if ((n_threads <= 1 || n_songs <= 1) && deadline_ms <= 0) {
+    match_songs (seq, corpus, 0, n_songs, rank, prune ? &prune_stats : NULL, scratch);
+    metric_add (run_metrics.cells, -prune_stats.cells_pruned);
+    return;
+  }
+
+  ScanPool &pool = scan_pool;
+  pool.seq = &seq;
+  pool.corpus = &corpus;
+  // a few blocks per thread keep the workers balanced
+  pool.block = max (1, n_songs / (8 * n_threads));
+  pool.n_blocks = (n_songs + pool.block - 1) / pool.block;
+  pool.next = 0;
+  pool.order = NULL;
+  pool.deadline = 0;
+  if (deadline_ms > 0) {
+    scan_order (seq, corpus, start + deadline_ms / 1e3, scan_songs);
+    pool.block = 1;
+    pool.n_blocks = n_songs;
+    pool.order = &scan_songs;
+    pool.deadline = start + deadline_ms / 1e3;
+  }
+  pthread_mutex_init (&pool.lock, NULL);
+
+  vector<ScanWorker> &workers = scan_workers;
+  workers.resize (max (1, min (n_threads, pool.n_blocks)));
+  for (int t = 0; t < workers.size (); t++) {
+    workers[t].pool = &pool;
+    workers[t].rank.clear ();
+    workers[t].blocks.clear ();
+    workers[t].ends.clear ();
+    reset_pruning (workers[t].pr);
+    pthread_create (&workers[t].thread, NULL, scan_worker, &workers[t]);
+  }
+  for (int t = 0; t < workers.size (); t++) {
+    pthread_join (workers[t].thread, NULL);
+    add_pruning (prune_stats, workers[t].pr);
+  }
+  pthread_mutex_destroy (&pool.lock);
+  metric_add (run_metrics.cells, -prune_stats.cells_pruned);
+
+  // merge the partial ranks block by block, skipping the ones never started
+  pool.owner.assign (pool.n_blocks, -1);
+  pool.begin.resize (pool.n_blocks);
+  pool.end.resize (pool.n_blocks);
+  for (int t = 0; t < workers.size (); t++) {
+    for (int k = 0; k < workers[t].blocks.size (); k++) {
+      int b = workers[t].blocks[k];
+      pool.owner[b] = t;
+      pool.begin[b] = (k > 0) ? workers[t].ends[k-1] : 0;
+      pool.end[b] = workers[t].ends[k];
+    }
+  }
+  scan_visited = 0;
+  for (int b = 0; b < pool.n_blocks; b++) {
+    if (pool.owner[b] < 0) continue;
+    vector<pair<int,double> > &r = workers[pool.owner[b]].rank;
+    rank.insert (rank.end (), r.begin () + pool.begin[b], r.begin () + pool.end[b]);
+    scan_visited += (pool.order != NULL) ? 1 : min (pool.block, n_songs - b * pool.block);
+  }
+  if (deadline_ms > 0)
+    verbmsg ("deadline: %d of %d songs visited in %.3f ms\n", scan_visited, n_songs,
+             (now () - start) * 1e3);
+}
+
+/**
+ * @brief Splits the corpus in tiles of consecutive songs.
+ *
+ * Each tile holds songs whose sequences add up to about the given size, so
+ * that a tile stays in cache while several queries are matched against it.
+ *
+ * @param corpus Corpus loaded by load_corpus.
+ * @param bytes Size of the sequences of a tile.
+ * @param bounds Index of the first song of each tile, plus the end.
+ */
+void corpus_tiles (Corpus &corpus, long bytes, vector<int> &bounds)
+{
+  long size = 0;
+  bounds.clear ();
+  bounds.push_back (0);
+  for (int i = 0; i < corpus.songs.size (); i++) {
+    for (int j = 0; j < corpus.songs[i].samples.size (); j++)
+      size += corpus.songs[i].samples[j].size * sizeof (int);
+    if (size >= bytes || i + 1 == corpus.songs.size ()) {
+      bounds.push_back (i + 1);
+      size = 0;
+    }
+  }
+}
+
+// a query of a batch
+struct Query {
+  string input, output;
+  vector<int> seq;
+  vector<pair<int,double> > rank;
+  Pruning pr;
+};
+
+/**
+ * @brief Matches a group of queries against the corpus, tile by tile.
+ *
+ * Every query of the group is matched against a tile before moving to the
+ * next one. The tiles are scanned in database order and each query keeps its
+ * own rank list and pruning state, so every rank is the same one match_corpus
+ * gives for the query alone.
+ *
+ * @param queries First query of the group.
+ * @param n Number of queries of the group.
+ * @param corpus Corpus loaded by load_corpus.
+ * @param bounds Tiles made by corpus_tiles.
+ * @param sc Scratch buffers of the thread.
+ */
+void match_tiles (Query *queries, int n, Corpus &corpus, vector<int> &bounds, Scratch &sc)
+{
+  for (int q = 0; q < n; q++) {
+    queries[q].rank.clear ();
+    reset_pruning (queries[q].pr);
+  }
+  for (int t = 0; t + 1 < bounds.size (); t++)
+    for (int q = 0; q < n; q++)
+      match_songs (queries[q].seq, corpus, bounds[t], bounds[t + 1], queries[q].rank,
+                   prune ? &queries[q].pr : NULL, sc);
+}
+
+/**
+ * @brief Shows the pruning counters of the last query when being verbose.
+ */
+void print_pruning (Pruning &pr)
+{
+  verbmsg ("pruning: %ld samples, %ld pruned by bound, %ld abandoned, %ld cells computed, %ld cells pruned\n",
+           pr.samples, pr.samples_pruned, pr.samples_abandoned, pr.cells, pr.cells_pruned);
+}
+
+// ties of similarity are ranked in corpus order
+bool cmp (pair<int,double> p1, pair<int,double> p2)
+{
+  return p1.second < p2.second || (p1.second == p2.second && p1.first < p2.first);
+}
+
+bool worse (pair<int,double> p1, pair<int,double> p2)
+{
+  return cmp (p2, p1);
+}
+
+/**
+ * @brief Writes a string as xml text, escaped as tinyxml2 does.
+ */
+void print_xml_text (FILE *stream, const char *str)
+{
+  for (; *str; str++) {
+    if (*str == '&') fputs ("&amp;", stream);
+    else if (*str == '<') fputs ("&lt;", stream);
+    else if (*str == '>') fputs ("&gt;", stream);
+    else putc (*str, stream);
+  }
+}
+
+void print_xml_element (FILE *stream, const char *name, const char *str)
+{
+  fprintf (stream, "        <%s>", name);
+  print_xml_text (stream, str);
+  fprintf (stream, "</%s>\n", name);
+}
+
+/**
+ * @brief Writes a rank xml document.
+ *
+ * The document is printed directly, byte for byte as tinyxml2 printed the
+ * rank element built for it.
+ *
+ * @param stream Pointer to a FILE object that identifies an output stream.
+ * @param songs Songs of the rank, in order.
+ * @param attributes Attributes of the rank element, with a leading space.
+ */
+void print_rank (FILE *stream, const vector<RankSong> &songs, const char *attributes)
+{
+  fprintf (stream, "<rank%s", attributes);
+  if (songs.empty ()) {
+    fprintf (stream, "/>\n");
+    return;
+  }
+  fprintf (stream, ">\n");
+  for (int k = 0; k < songs.size (); k++) {
+    if (songs[k].order >= 0) fprintf (stream, "    <song order=\"%ld\">\n", songs[k].order);
+    else fprintf (stream, "    <song>\n");
+    print_xml_element (stream, "author", songs[k].author);
+    print_xml_element (stream, "title", songs[k].title);
+    print_xml_element (stream, "genre", songs[k].genre);
+    print_xml_element (stream, "thumb_url", songs[k].url);
+    fprintf (stream, "        <similarity>%.17g</similarity>\n", songs[k].similarity);
+    fprintf (stream, "    </song>\n");
+  }
+  fprintf (stream, "</rank>\n");
+}
+
+/**
+ * @brief Attributes telling whether a scan left songs out.
+ */
+string coverage_attributes (bool partial, int visited, int songs)
+{
+  char buf[96];
+  sprintf (buf, " partial=\"%s\" visited=\"%d\" songs=\"%d\"", partial ? "true" : "false", visited, songs);
+  return buf;
+}
+
+/**
+ * @brief Whether a song is already in the best songs of a rank.
+ *
+ * Only the rank_size songs taken so far are looked at, so the cost does not
+ * depend on the size of the catalog.
+ */
+bool in_rank (const vector<pair<int,double> > &best, int song)
+{
+  for (int k = 0; k < best.size (); k++)
+    if (best[k].first == song) return true;
+  return false;
+}
+
+/**
+ * @brief Writes the rank list as xml.
+ *
+ * Writes the best rank_size different songs with their metadata and
+ * similarity. The rank list is turned into a heap and only the entries
+ * needed to find those songs are taken out of it, so it is left unordered.
+ * With a deadline, the rank element tells whether the scan left songs out.
+ *
+ * @param rank Rank list with <song, similarity> pairs.
+ * @param corpus Corpus with the metadata of the songs.
+ * @param stream Pointer to a FILE object that identifies an output stream.
+ */
+void save_rank (vector<pair<int,double> > &rank, Corpus &corpus, FILE *stream)
+{
+  vector<pair<int,double> > best;
+
+  StageTimer sort_timer (STAGE_SORT);
+  make_heap (rank.begin (), rank.end (), worse);
+  for (int end = rank.size (); best.size () < rank_size && end > 0; end--) {
+    pop_heap (rank.begin (), rank.begin () + end, worse);
+    if (!in_rank (best, rank[end - 1].first)) best.push_back (rank[end - 1]);
+  }
+
+  // save the result
+  StageTimer output_timer (STAGE_OUTPUT);
+  vector<RankSong> songs (best.size ());
+  for (int k = 0; k < best.size (); k++) {
+    Song &song = corpus.songs[best[k].first];
+    songs[k].author = text (corpus, song.author);
+    songs[k].title = text (corpus, song.title);
+    songs[k].genre = text (corpus, song.genre);
+    songs[k].url = text (corpus, song.url);
+    songs[k].similarity = best[k].second;
+    // the coordinator breaks ties of the shard ranks by corpus position
+    songs[k].order = (n_shards > 1) ? song.order : -1;
+  }
+  // with a deadline, tell the client whether it left songs out
+  string attributes;
+  if (deadline_ms > 0)
+    attributes = coverage_attributes (scan_visited < corpus.songs.size (), scan_visited, corpus.songs.size ());
+  print_rank (stream, songs, attributes.c_str ());
+}
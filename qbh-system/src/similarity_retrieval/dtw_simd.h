@@ -0,0 +1,270 @@
+/*
+ Copyright (C) 2013-2014 Jose Alemany Bordera <joalbor1@inf.upv.es>
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+ * Vectorized DTW and UDS kernels.
+ *
+ * The cell (i, j) only depends on (i, j-1), (i-1, j) and (i-1, j-1), so all
+ * the cells of an anti-diagonal d = i + j can be computed at once from the two
+ * previous anti-diagonals. Diagonals are stored indexed by the row i, which
+ * makes the three predecessors contiguous: left and up are d-1 at i and i-1,
+ * and the diagonal one is d-2 at i-1. The reference is read reversed so that
+ * r_seq[d-i] is contiguous too.
+ *
+ * The tie-breaking of min () is reproduced lane by lane, 1000 sentinels
+ * included, so the last row is the same one dp_rows<DtwStep> computes. The UDS
+ * recurrence is computed the same way, one cell per lane, and pos_min () ties
+ * are kept too, so the last row is the same one dp_rows<UdsStep> computes.
+ */
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define SIMD_WIDTH                8
+#define vec_t                     __m256i
+#define vec_load(p)               _mm256_loadu_si256 ((const __m256i *) (p))
+#define vec_store(p,a)            _mm256_storeu_si256 ((__m256i *) (p), a)
+#define vec_set1(x)               _mm256_set1_epi32 (x)
+#define vec_add(a,b)              _mm256_add_epi32 (a, b)
+#define vec_sub(a,b)              _mm256_sub_epi32 (a, b)
+#define vec_abs(a)                _mm256_abs_epi32 (a)
+#define vec_min(a,b)              _mm256_min_epi32 (a, b)
+#define vec_gt(a,b)               _mm256_cmpgt_epi32 (a, b)
+#define vec_eq(a,b)               _mm256_cmpeq_epi32 (a, b)
+#define vec_and(a,b)              _mm256_and_si256 (a, b)
+#define vec_andnot(a,b)           _mm256_andnot_si256 (a, b)
+#define vec_or(a,b)               _mm256_or_si256 (a, b)
+#define vec_blend(a,b,m)          _mm256_blendv_epi8 (a, b, m)
+#elif defined(__SSE4_1__)
+#include <smmintrin.h>
+#define SIMD_WIDTH                4
+#define vec_t                     __m128i
+#define vec_load(p)               _mm_loadu_si128 ((const __m128i *) (p))
+#define vec_store(p,a)            _mm_storeu_si128 ((__m128i *) (p), a)
+#define vec_set1(x)               _mm_set1_epi32 (x)
+#define vec_add(a,b)              _mm_add_epi32 (a, b)
+#define vec_sub(a,b)              _mm_sub_epi32 (a, b)
+#define vec_abs(a)                _mm_abs_epi32 (a)
+#define vec_min(a,b)              _mm_min_epi32 (a, b)
+#define vec_gt(a,b)               _mm_cmpgt_epi32 (a, b)
+#define vec_eq(a,b)               _mm_cmpeq_epi32 (a, b)
+#define vec_and(a,b)              _mm_and_si128 (a, b)
+#define vec_andnot(a,b)           _mm_andnot_si128 (a, b)
+#define vec_or(a,b)               _mm_or_si128 (a, b)
+#define vec_blend(a,b,m)          _mm_blendv_epi8 (a, b, m)
+#else
+#define SIMD_WIDTH                1
+#endif
+
+/**
+ * @brief Computes one cell of the DTW grid.
+ *
+ * Scalar version of the vector step, used for the lanes that do not fill a
+ * whole register and when no vector instructions are available.
+ */
+void dtw_cell (Row &c, Row &b, Row &a, int i, int dist_ij)
+{
+  int m = min_step (b.height[i], b.score[i], b.height[i-1], b.score[i-1], a.height[i-1], a.score[i-1], dist_ij);
+  if (m == 1) {
+    c.ini[i] = b.ini[i]; c.score[i] = b.score[i] + abs (b.height[i] - dist_ij); c.height[i] = b.height[i];
+  } else if (m == 2) {
+    c.ini[i] = b.ini[i-1]; c.score[i] = b.score[i-1] + abs (b.height[i-1] - dist_ij); c.height[i] = b.height[i-1];
+  } else {
+    c.ini[i] = a.ini[i-1]; c.score[i] = a.score[i-1] + abs (a.height[i-1] - dist_ij); c.height[i] = a.height[i-1];
+  }
+}
+
+/**
+ * @brief Computes the DTW recurrence along anti-diagonals.
+ *
+ * Leaves in sc.last the same last row dp_rows<DtwStep> computes. Rows cannot be
+ * abandoned here, so the pruning state only counts the cells.
+ *
+ * @param seq Humming MIDI sequence.
+ * @param r_seq Reference MIDI sequence.
+ * @param r_size Length of the reference sequence.
+ * @param sc Scratch buffers, the three diagonals and the last row.
+ * @param pr Pruning counters, may be NULL.
+ */
+void dtw_simd_rows (const vector<int> &seq, const int *r_seq, int r_size, Scratch &sc, Pruning *pr)
+{
+  int n = seq.size (), m = r_size;
+  Row *diag = sc.rows;
+  vector<int> &r_rev = sc.r_rev;
+  vector<Cost> &prev = sc.last;
+
+  for (int k = 0; k < 3; k++) diag[k].resize (n);
+  r_rev.resize (m);
+  for (int j = 0; j < m; j++) r_rev[m-1-j] = r_seq[j];
+  prev.resize (m, Cost (0, 0, 0, 0));
+  if (pr != NULL) pr->cells += (long) (n - 1) * m;
+
+  for (int d = 0; d < n + m - 1; d++) {
+    Row &c = diag[d % 3], &b = diag[(d + 2) % 3], &a = diag[(d + 1) % 3];
+    int lo = max (0, d - m + 1), hi = min (n - 1, d);
+
+    // first row: every reference position may start a match
+    if (lo == 0) {
+      c.ini[0] = d;
+      c.score[0] = 0;
+      c.height[0] = seq[0] - r_seq[d];
+    }
+    // first column: only reachable from the cell above
+    if (d >= 1 && d < n) {
+      int dist_ij = seq[d] - r_seq[0];
+      c.ini[d] = b.ini[d-1];
+      c.score[d] = b.score[d-1] + abs (b.height[d-1] - dist_ij);
+      c.height[d] = b.height[d-1];
+    }
+    // inner cells, rows 1..min(hi, d-1)
+    int i = max (lo, 1), last = min (hi, d - 1);
+    const int *r = &r_rev[0] + (m - 1 - d);
+
+#if SIMD_WIDTH > 1
+    const vec_t sentinel = vec_set1 (1000);
+    for (; i + SIMD_WIDTH - 1 <= last; i += SIMD_WIDTH) {
+      vec_t dist = vec_sub (vec_load (&seq[i]), vec_load (r + i));
+      vec_t n1 = vec_load (&b.ini[i]), s1 = vec_load (&b.score[i]), h1 = vec_load (&b.height[i]);
+      vec_t n2 = vec_load (&b.ini[i-1]), s2 = vec_load (&b.score[i-1]), h2 = vec_load (&b.height[i-1]);
+      vec_t n3 = vec_load (&a.ini[i-1]), s3 = vec_load (&a.score[i-1]), h3 = vec_load (&a.height[i-1]);
+      vec_t a1 = vec_abs (vec_sub (h1, dist));
+      vec_t a2 = vec_abs (vec_sub (h2, dist));
+      vec_t a3 = vec_abs (vec_sub (h3, dist));
+
+      // unique minimum of the height distances
+      vec_t u1 = vec_and (vec_gt (a2, a1), vec_gt (a3, a1));
+      vec_t u2 = vec_and (vec_gt (a1, a2), vec_gt (a3, a2));
+      vec_t tie = vec_eq (vec_or (vec_or (u1, u2), vec_and (vec_gt (a1, a3), vec_gt (a2, a3))), vec_set1 (0));
+      // otherwise pos_min of the scores of the tied ones
+      vec_t am = vec_min (a1, vec_min (a2, a3));
+      vec_t t1 = vec_blend (sentinel, s1, vec_eq (a1, am));
+      vec_t t2 = vec_blend (sentinel, s2, vec_eq (a2, am));
+      vec_t t3 = vec_blend (sentinel, s3, vec_eq (a3, am));
+      vec_t p1 = vec_and (vec_gt (t2, t1), vec_gt (t3, t1));
+      vec_t p2 = vec_and (vec_gt (t1, t2), vec_gt (t3, t2));
+      vec_t pick1 = vec_or (u1, vec_and (tie, p1));
+      vec_t pick2 = vec_or (u2, vec_and (tie, vec_andnot (p1, p2)));
+
+      vec_t ni = vec_blend (vec_blend (n3, n2, pick2), n1, pick1);
+      vec_t sc = vec_blend (vec_blend (vec_add (s3, a3), vec_add (s2, a2), pick2), vec_add (s1, a1), pick1);
+      vec_t he = vec_blend (vec_blend (h3, h2, pick2), h1, pick1);
+      vec_store (&c.ini[i], ni);
+      vec_store (&c.score[i], sc);
+      vec_store (&c.height[i], he);
+    }
+#endif
+    for (; i <= last; i++)
+      dtw_cell (c, b, a, i, seq[i] - r[i]);
+
+    // keep the cell of the last row
+    if (hi == n - 1) {
+      int j = d - (n - 1);
+      prev[j] = Cost (c.ini[n-1], j, c.score[n-1], c.height[n-1]);
+    }
+  }
+}
+
+/**
+ * @brief Computes one cell of the UDS edit distance grid.
+ *
+ * Scalar version of the vector step of dp_simd_rows.
+ */
+void dp_cell (Row &c, Row &b, Row &a, int i, bool eq)
+{
+  int dist_ij = eq ? 0 : 2;
+  int s1 = b.score[i] + dist_ij/2, s2 = b.score[i-1] + dist_ij, s3 = a.score[i-1] + (3*dist_ij)/2;
+  int m = pos_min (s1, s2, s3);
+  if (m == 1) {
+    c.ini[i] = b.ini[i]; c.score[i] = s1;
+  } else if (m == 2) {
+    c.ini[i] = b.ini[i-1]; c.score[i] = s2;
+  } else {
+    c.ini[i] = a.ini[i-1]; c.score[i] = s3;
+  }
+}
+
+/**
+ * @brief Computes the UDS edit distance recurrence along anti-diagonals.
+ *
+ * Leaves in sc.last the same last row dp_rows<UdsStep> computes. Rows cannot be
+ * abandoned here, so the pruning state only counts the cells.
+ *
+ * @param seq Humming UDS sequence.
+ * @param r_seq Reference UDS sequence.
+ * @param r_size Length of the reference sequence.
+ * @param sc Scratch buffers, the three diagonals and the last row.
+ * @param pr Pruning counters, may be NULL.
+ */
+void dp_simd_rows (const vector<int> &seq, const int *r_seq, int r_size, Scratch &sc, Pruning *pr)
+{
+  int n = seq.size (), m = r_size;
+  Row *diag = sc.rows;
+  vector<int> &r_rev = sc.r_rev;
+  vector<Cost> &prev = sc.last;
+
+  for (int k = 0; k < 3; k++) diag[k].resize (n);
+  r_rev.resize (m);
+  for (int j = 0; j < m; j++) r_rev[m-1-j] = r_seq[j];
+  prev.resize (m, Cost (0, 0, 0, 0));
+  if (pr != NULL) pr->cells += (long) (n - 1) * m;
+
+  for (int d = 0; d < n + m - 1; d++) {
+    Row &c = diag[d % 3], &b = diag[(d + 2) % 3], &a = diag[(d + 1) % 3];
+    int lo = max (0, d - m + 1), hi = min (n - 1, d);
+
+    // first row: every reference position may start a match
+    if (lo == 0) {
+      c.ini[0] = d;
+      c.score[0] = (seq[0] == r_seq[d]) ? 0 : 4;
+    }
+    // first column: only reachable from the cell above
+    if (d >= 1 && d < n) {
+      c.ini[d] = b.ini[d-1];
+      c.score[d] = b.score[d-1] + ((seq[d] == r_seq[0]) ? 0 : 4);
+    }
+    // inner cells, rows 1..min(hi, d-1)
+    int i = max (lo, 1), last = min (hi, d - 1);
+    const int *r = &r_rev[0] + (m - 1 - d);
+
+#if SIMD_WIDTH > 1
+    const vec_t one = vec_set1 (1), two = vec_set1 (2), three = vec_set1 (3);
+    for (; i + SIMD_WIDTH - 1 <= last; i += SIMD_WIDTH) {
+      vec_t eq = vec_eq (vec_load (&seq[i]), vec_load (r + i));
+      vec_t s1 = vec_add (vec_load (&b.score[i]), vec_andnot (eq, one));
+      vec_t s2 = vec_add (vec_load (&b.score[i-1]), vec_andnot (eq, two));
+      vec_t s3 = vec_add (vec_load (&a.score[i-1]), vec_andnot (eq, three));
+
+      // pos_min: a unique minimum among the first two, otherwise the third
+      vec_t pick1 = vec_and (vec_gt (s2, s1), vec_gt (s3, s1));
+      vec_t pick2 = vec_and (vec_gt (s1, s2), vec_gt (s3, s2));
+
+      vec_t ni = vec_blend (vec_blend (vec_load (&a.ini[i-1]), vec_load (&b.ini[i-1]), pick2), vec_load (&b.ini[i]), pick1);
+      vec_t sc = vec_blend (vec_blend (s3, s2, pick2), s1, pick1);
+      vec_store (&c.ini[i], ni);
+      vec_store (&c.score[i], sc);
+    }
+#endif
+    for (; i <= last; i++)
+      dp_cell (c, b, a, i, seq[i] == r[i]);
+
+    // keep the cell of the last row
+    if (hi == n - 1) {
+      int j = d - (n - 1);
+      prev[j] = Cost (c.ini[n-1], j, c.score[n-1], 0);
+    }
+  }
+}
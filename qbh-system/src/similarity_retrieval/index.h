@@ -0,0 +1,303 @@
+/*
+ Copyright (C) 2013-2014 Jose Alemany Bordera <joalbor1@inf.upv.es>
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+ * Inverted index of the UDS sequences.
+ *
+ * Every n-gram of gram consecutive UDS symbols of the corpus points to the
+ * samples and positions where it appears. A query looks up its own n-grams
+ * and votes for the offset pos - qpos at which each hit would align it with
+ * the sample. Offsets with enough votes become windows around the expected
+ * match, and only those windows are matched by the DP.
+ *
+ * Index file, as written by build_corpus (native byte order):
+ *
+ *   IndexHeader
+ *   int          offsets[5^gram + 1]    postings of each n-gram
+ *   Posting      postings[n_postings]
+ */
+#define INDEX_MAGIC "QBHINDX1"
+
+// index stuff
+char * db_index = NULL;
+int index_gram = 6;
+int index_hits = 2;
+
+struct IndexHeader {
+  char magic[8];
+  int gram, n_songs, n_postings;
+};
+
+struct Posting {
+  int song, sample, pos;
+};
+
+struct Index {
+  int gram, n_keys;
+  const int *offsets;
+  const Posting *postings;
+  void *map;
+  size_t map_size;
+  Index () : gram(0), n_keys(0), offsets(NULL), postings(NULL), map(NULL), map_size(0) {}
+};
+
+// votes of the query n-grams for an offset of a sample
+struct Vote {
+  int song, sample, offset;
+  bool operator< (const Vote &v) const
+  {
+    if (song != v.song) return song < v.song;
+    if (sample != v.sample) return sample < v.sample;
+    return offset < v.offset;
+  }
+};
+
+vector<Vote> index_votes;
+
+
+/* Functions */
+
+int index_keys (int gram)
+{
+  int n = 1;
+  for (int i = 0; i < gram; i++) n *= 5;
+  return n;
+}
+
+/**
+ * @brief Key of the n-gram starting at a UDS sequence.
+ *
+ * @return The key, or -1 if a symbol is not a UDS one.
+ */
+int gram_key (const int *seq, int gram)
+{
+  int key = 0;
+  for (int i = 0; i < gram; i++) {
+    int c;
+    switch (seq[i]) {
+      case 'D': c = 0; break;
+      case 'U': c = 1; break;
+      case 'S': c = 2; break;
+      case 'L': c = 3; break;
+      case 'E': c = 4; break;
+      default: return -1;
+    }
+    key = key * 5 + c;
+  }
+  return key;
+}
+
+/**
+ * @brief Counts or places the postings of every n-gram of a corpus.
+ *
+ * @param corpus Corpus loaded with the uds method.
+ * @param gram Length of the n-grams.
+ * @param next Counters of each key, or next free position when placing.
+ * @param postings Postings to fill, NULL to only count them.
+ */
+void index_postings (Corpus &corpus, int gram, vector<int> &next, Posting *postings)
+{
+  for (int i = 0; i < corpus.songs.size (); i++) {
+    vector<Sample> &samples = corpus.songs[i].samples;
+    for (int j = 0; j < samples.size (); j++) {
+      const int *seq = corpus.values + samples[j].seq;
+      for (int k = 0; k + gram <= samples[j].size; k++) {
+        int key = gram_key (seq + k, gram);
+        if (key < 0) continue;
+        if (postings != NULL) {
+          Posting &p = postings[next[key]];
+          p.song = i;
+          p.sample = j;
+          p.pos = k;
+        }
+        next[key]++;
+      }
+    }
+  }
+}
+
+/**
+ * @brief Writes the index file of a corpus.
+ *
+ * @param path Path of the index file.
+ * @param corpus Corpus loaded with the uds method.
+ * @param gram Length of the n-grams.
+ */
+void save_index (const char *path, Corpus &corpus, int gram)
+{
+  int n_keys = index_keys (gram);
+  vector<int> count (n_keys, 0), offsets (n_keys + 1, 0);
+
+  index_postings (corpus, gram, count, NULL);
+  for (int key = 0; key < n_keys; key++)
+    offsets[key + 1] = offsets[key] + count[key];
+  vector<Posting> postings (offsets[n_keys]);
+  vector<int> next (offsets.begin (), offsets.end () - 1);
+  if (!postings.empty ())
+    index_postings (corpus, gram, next, &postings[0]);
+
+  IndexHeader h;
+  memcpy (h.magic, INDEX_MAGIC, sizeof (h.magic));
+  h.gram = gram;
+  h.n_songs = corpus.songs.size ();
+  h.n_postings = postings.size ();
+
+  FILE *out = fopen (path, "wb");
+  if (out == NULL) {
+    errmsg ("Error: could not open index output file '%s'\n", path);
+    exit (1);
+  }
+  fwrite (&h, sizeof (h), 1, out);
+  fwrite (&offsets[0], sizeof (int), offsets.size (), out);
+  if (!postings.empty ())
+    fwrite (&postings[0], sizeof (Posting), postings.size (), out);
+  if (fclose (out) != 0) {
+    errmsg ("Error: could not write index '%s'\n", path);
+    exit (1);
+  }
+}
+
+/**
+ * @brief Maps an index file in memory.
+ *
+ * @param path Path of the index file.
+ * @param corpus Corpus the index has been built from.
+ * @param index Index object where the file is mapped.
+ */
+void map_index (const char *path, Corpus &corpus, Index &index)
+{
+  struct stat st;
+  int fd = open (path, O_RDONLY);
+  if (fd < 0 || fstat (fd, &st) < 0) {
+    errmsg ("Error: could not open index '%s'\n", path);
+    exit (1);
+  }
+
+  void *map = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close (fd);
+  const IndexHeader *h = (const IndexHeader *) map;
+  if (map == MAP_FAILED || st.st_size < sizeof (IndexHeader) ||
+      memcmp (h->magic, INDEX_MAGIC, sizeof (h->magic)) != 0 ||
+      h->gram < 1 || h->gram > 12 ||
+      st.st_size != sizeof (IndexHeader) + (index_keys (h->gram) + 1) * sizeof (int) +
+                    h->n_postings * sizeof (Posting)) {
+    errmsg ("Error: '%s' is not a valid index\n", path);
+    exit (1);
+  }
+  if (h->n_songs != corpus.songs.size ()) {
+    errmsg ("Error: index '%s' does not match the database\n", path);
+    exit (1);
+  }
+
+  index.gram = h->gram;
+  index.n_keys = index_keys (h->gram);
+  index.offsets = (const int *) (h + 1);
+  index.postings = (const Posting *) (index.offsets + index.n_keys + 1);
+  index.map = map;
+  index.map_size = st.st_size;
+}
+
+/**
+ * @brief Adds the vote of an index hit for the offset it aligns the query to.
+ *
+ * @param p Posting of the hit.
+ * @param q Position of the hit in the query.
+ * @param bucket Offsets are grouped in buckets of this size.
+ */
+void add_vote (const Posting &p, int q, int bucket)
+{
+  Vote v;
+  v.song = p.song;
+  v.sample = p.sample;
+  // floor division, offsets may be negative
+  int off = p.pos - q;
+  v.offset = (off >= 0) ? off / bucket : -((-off + bucket - 1) / bucket);
+  index_votes.push_back (v);
+}
+
+/**
+ * @brief Turns the votes of a query into the windows to match.
+ *
+ * Each bucket of offsets with at least index_hits votes gives a window from
+ * one query length before it up to the longest admissible match after it.
+ * Overlapping windows of a sample are merged. The windows are left in
+ * scan_windows and match_corpus only matches them from then on.
+ *
+ * @param corpus Corpus loaded by load_corpus.
+ * @param n Length of the query.
+ * @param bucket Size of the buckets of offsets.
+ */
+void vote_windows (Corpus &corpus, int n, int bucket)
+{
+  vector<Vote> &votes = index_votes;
+  sort (votes.begin (), votes.end ());
+
+  for (int i = 0, j; i < votes.size (); i = j) {
+    for (j = i; j < votes.size () && !(votes[i] < votes[j]); j++);
+    if (j - i < index_hits) continue;
+
+    Window w;
+    w.song = votes[i].song;
+    w.sample = votes[i].sample;
+    w.first = max (0, votes[i].offset * bucket - n);
+    w.last = min (corpus.songs[w.song].samples[w.sample].size, (votes[i].offset + 1) * bucket + 3 * n);
+    if (w.first >= w.last) continue;
+    if (!scan_windows.empty ()) {
+      Window &b = scan_windows.back ();
+      if (b.song == w.song && b.sample == w.sample && w.first <= b.last) {
+        b.last = max (b.last, w.last);
+        continue;
+      }
+    }
+    scan_windows.push_back (w);
+  }
+  verbmsg ("index: %lu votes, %lu windows\n", votes.size (), scan_windows.size ());
+}
+
+/**
+ * @brief Finds the windows of the corpus worth matching against a query.
+ *
+ * Each n-gram of the query votes for the offsets it aligns with, grouped in
+ * buckets of half the query length, and vote_windows keeps the buckets with
+ * enough votes.
+ * A query shorter than an n-gram cannot be filtered, so every sample is
+ * matched completely.
+ *
+ * @param seq Converted humming sequence.
+ * @param corpus Corpus loaded by load_corpus.
+ * @param index Index mapped by map_index.
+ */
+void filter_corpus (const vector<int> &seq, Corpus &corpus, Index &index)
+{
+  StageTimer timer (STAGE_FILTER);
+  int n = seq.size (), gram = index.gram;
+  int bucket = max (gram, n / 2);
+
+  scan_windows.clear ();
+  filter_windows = (n >= gram);
+  if (!filter_windows) return;
+
+  index_votes.clear ();
+  for (int q = 0; q + gram <= n; q++) {
+    int key = gram_key (&seq[q], gram);
+    if (key < 0) continue;
+    for (int k = index.offsets[key]; k < index.offsets[key + 1]; k++)
+      add_vote (index.postings[k], q, bucket);
+  }
+  vote_windows (corpus, n, bucket);
+}
@@ -0,0 +1,276 @@
+/*
+ Copyright (C) 2013-2014 Jose Alemany Bordera <joalbor1@inf.upv.es>
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+ * Locality-sensitive hashing of the MIDI sequences.
+ *
+ * A melodic window is the vector of the window pitch intervals following a
+ * note, so it does not change when the melody is sung in another key, like
+ * the height offset of DTW. Each of the tables hashes a window with hashes
+ * p-stable projections floor ((a . v + b) / width), so close windows share a
+ * bucket in some table with high probability. A query looks up the buckets
+ * of its own windows, and the hits vote for windows of the samples exactly
+ * as the UDS index does, which are then matched by DTW.
+ *
+ * The projections are drawn from a fixed seed, so build_corpus and the
+ * matching programs compute the same ones from the parameters in the file.
+ *
+ * LSH file, as written by build_corpus (native byte order):
+ *
+ *   LshHeader
+ *   int          offsets[tables * buckets + 1]    postings of each bucket
+ *   Posting      postings[n_postings]
+ */
+#define LSH_MAGIC "QBHLSH01"
+
+// lsh stuff
+char * db_lsh = NULL;
+int lsh_window = 8;
+int lsh_tables = 8;
+int lsh_hashes = 3;
+double lsh_width = 4.0;
+
+struct LshHeader {
+  char magic[8];
+  int window, tables, hashes, buckets;
+  double width;
+  int n_songs, n_postings;
+};
+
+struct Lsh {
+  LshHeader params;
+  vector<double> a, b;         // projections of each hash of each table
+  const int *offsets;
+  const Posting *postings;
+  void *map;
+  size_t map_size;
+  Lsh () : params(), offsets(NULL), postings(NULL), map(NULL), map_size(0) {}
+};
+
+
+/* Functions */
+
+/**
+ * @brief Draws the projections of the hashes.
+ *
+ * Uses its own generator so that the projections do not depend on the C
+ * library.
+ */
+void lsh_projections (Lsh &lsh)
+{
+  LshHeader &h = lsh.params;
+  unsigned long long x = 0x2545F4914F6CDD1DULL;
+  int n = h.tables * h.hashes;
+
+  lsh.a.resize (n * h.window);
+  lsh.b.resize (n);
+  for (int k = 0; k < n * h.window + n; k++) {
+    // two uniform numbers in (0, 1], normal by Box-Muller
+    double u[2];
+    for (int i = 0; i < 2; i++) {
+      x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+      u[i] = ((x >> 11) + 1.0) / 9007199254740992.0;
+    }
+    if (k < n * h.window)
+      lsh.a[k] = sqrt (-2 * log (u[0])) * cos (2 * M_PI * u[1]);
+    else
+      lsh.b[k - n * h.window] = u[0] * h.width;
+  }
+}
+
+/**
+ * @brief Bucket of the window following a note in a table.
+ *
+ * @param seq MIDI sequence, with at least window notes after pos.
+ * @param pos Position of the first note of the window.
+ * @param lsh Parameters and projections.
+ * @param t Table.
+ * @return Key of the bucket among the ones of every table.
+ */
+int lsh_key (const int *seq, int pos, Lsh &lsh, int t)
+{
+  LshHeader &h = lsh.params;
+  unsigned int key = t;
+  for (int k = 0; k < h.hashes; k++) {
+    const double *a = &lsh.a[(t * h.hashes + k) * h.window];
+    double dot = lsh.b[t * h.hashes + k];
+    for (int i = 0; i < h.window; i++)
+      dot += a[i] * (seq[pos + i + 1] - seq[pos + i]);
+    key = key * 1000003u + (unsigned int) (int) floor (dot / h.width);
+  }
+  return t * h.buckets + key % h.buckets;
+}
+
+/**
+ * @brief Counts or places the postings of every window of a corpus.
+ *
+ * @param corpus Corpus loaded with the dtw method.
+ * @param lsh Parameters and projections.
+ * @param next Counters of each key, or next free position when placing.
+ * @param postings Postings to fill, NULL to only count them.
+ */
+void lsh_postings (Corpus &corpus, Lsh &lsh, vector<int> &next, Posting *postings)
+{
+  for (int i = 0; i < corpus.songs.size (); i++) {
+    vector<Sample> &samples = corpus.songs[i].samples;
+    for (int j = 0; j < samples.size (); j++) {
+      const int *seq = corpus.values + samples[j].seq;
+      for (int k = 0; k + lsh.params.window < samples[j].size; k++) {
+        for (int t = 0; t < lsh.params.tables; t++) {
+          int key = lsh_key (seq, k, lsh, t);
+          if (postings != NULL) {
+            Posting &p = postings[next[key]];
+            p.song = i;
+            p.sample = j;
+            p.pos = k;
+          }
+          next[key]++;
+        }
+      }
+    }
+  }
+}
+
+/**
+ * @brief Writes the LSH file of a corpus.
+ *
+ * There is about one bucket per window, rounded up to a power of two.
+ *
+ * @param path Path of the LSH file.
+ * @param corpus Corpus loaded with the dtw method.
+ * @param window Intervals of a window.
+ * @param tables Number of hash tables.
+ * @param hashes Hashes of a table.
+ * @param width Width of the projection buckets, in semitones.
+ */
+void save_lsh (const char *path, Corpus &corpus, int window, int tables, int hashes, double width)
+{
+  Lsh lsh;
+  LshHeader &h = lsh.params;
+  memcpy (h.magic, LSH_MAGIC, sizeof (h.magic));
+  h.window = window;
+  h.tables = tables;
+  h.hashes = hashes;
+  h.width = width;
+  h.n_songs = corpus.songs.size ();
+  long n_windows = 0;
+  for (int i = 0; i < corpus.songs.size (); i++)
+    for (int j = 0; j < corpus.songs[i].samples.size (); j++)
+      n_windows += max (0, corpus.songs[i].samples[j].size - window);
+  for (h.buckets = 1024; h.buckets < n_windows; h.buckets *= 2);
+  lsh_projections (lsh);
+
+  int n_keys = tables * h.buckets;
+  vector<int> count (n_keys, 0), offsets (n_keys + 1, 0);
+  lsh_postings (corpus, lsh, count, NULL);
+  for (int key = 0; key < n_keys; key++)
+    offsets[key + 1] = offsets[key] + count[key];
+  vector<Posting> postings (offsets[n_keys]);
+  vector<int> next (offsets.begin (), offsets.end () - 1);
+  if (!postings.empty ())
+    lsh_postings (corpus, lsh, next, &postings[0]);
+  h.n_postings = postings.size ();
+
+  FILE *out = fopen (path, "wb");
+  if (out == NULL) {
+    errmsg ("Error: could not open lsh output file '%s'\n", path);
+    exit (1);
+  }
+  fwrite (&h, sizeof (h), 1, out);
+  fwrite (&offsets[0], sizeof (int), offsets.size (), out);
+  if (!postings.empty ())
+    fwrite (&postings[0], sizeof (Posting), postings.size (), out);
+  if (fclose (out) != 0) {
+    errmsg ("Error: could not write lsh file '%s'\n", path);
+    exit (1);
+  }
+}
+
+/**
+ * @brief Maps an LSH file in memory.
+ *
+ * @param path Path of the LSH file.
+ * @param corpus Corpus the file has been built from.
+ * @param lsh LSH object where the file is mapped.
+ */
+void map_lsh (const char *path, Corpus &corpus, Lsh &lsh)
+{
+  struct stat st;
+  int fd = open (path, O_RDONLY);
+  if (fd < 0 || fstat (fd, &st) < 0) {
+    errmsg ("Error: could not open lsh file '%s'\n", path);
+    exit (1);
+  }
+
+  void *map = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close (fd);
+  const LshHeader *h = (const LshHeader *) map;
+  if (map == MAP_FAILED || st.st_size < sizeof (LshHeader) ||
+      memcmp (h->magic, LSH_MAGIC, sizeof (h->magic)) != 0 ||
+      h->window < 1 || h->tables < 1 || h->hashes < 1 || h->buckets < 1 || h->width <= 0 ||
+      st.st_size != sizeof (LshHeader) + ((long) h->tables * h->buckets + 1) * sizeof (int) +
+                    (long) h->n_postings * sizeof (Posting)) {
+    errmsg ("Error: '%s' is not a valid lsh file\n", path);
+    exit (1);
+  }
+  if (h->n_songs != corpus.songs.size ()) {
+    errmsg ("Error: lsh file '%s' does not match the database\n", path);
+    exit (1);
+  }
+
+  lsh.params = *h;
+  lsh_projections (lsh);
+  lsh.offsets = (const int *) (h + 1);
+  lsh.postings = (const Posting *) (lsh.offsets + h->tables * h->buckets + 1);
+  lsh.map = map;
+  lsh.map_size = st.st_size;
+}
+
+/**
+ * @brief Finds the windows of the corpus worth matching against a query.
+ *
+ * Each melodic window of the query votes, in every table, for the offsets
+ * its bucket aligns it with, and vote_windows keeps the buckets of offsets
+ * with enough votes.
+ * A query shorter than a window cannot be filtered, so every sample is
+ * matched completely.
+ *
+ * @param seq Converted humming sequence.
+ * @param corpus Corpus loaded by load_corpus.
+ * @param lsh LSH file mapped by map_lsh.
+ */
+void filter_corpus_lsh (const vector<int> &seq, Corpus &corpus, Lsh &lsh)
+{
+  StageTimer timer (STAGE_FILTER);
+  int n = seq.size (), window = lsh.params.window;
+  int bucket = max (window, n / 2);
+
+  scan_windows.clear ();
+  filter_windows = (n > window);
+  if (!filter_windows) return;
+
+  index_votes.clear ();
+  for (int q = 0; q + window < n; q++) {
+    for (int t = 0; t < lsh.params.tables; t++) {
+      int key = lsh_key (&seq[0], q, lsh, t);
+      for (int k = lsh.offsets[key]; k < lsh.offsets[key + 1]; k++)
+        add_vote (lsh.postings[k], q, bucket);
+    }
+  }
+  vote_windows (corpus, n, bucket);
+}
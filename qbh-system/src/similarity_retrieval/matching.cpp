@@ -17,6 +17,11 @@
 */
 
 #include "utils.h"
+#include "corpus.h"
+#include "segments.h"
+#include "index.h"
+#include "lsh.h"
+#include "server.h"
 
 
 /* Functions */
@@ -37,9 +42,26 @@ void usage (FILE * stream, int exit_code)
   fprintf (stream, "usage: %s humming_input [ options ] \n", prog_name);
   fprintf (stream,
            "       -i      --input-database   xml file database\n"
+           "       -b      --binary-database  binary corpus file built by build_corpus\n"
+           "       -u      --segments         segment manifest written by update_corpus\n"
+           "       -n      --index            only match the uds windows found in this index\n"
+           "       -l      --lsh              only match the dtw windows found in these lsh tables\n"
+           "       -k      --index-hits       index hits a window needs to be matched\n"
            "       -o      --output-rank      output xml file with the rank list\n"
            "       -m      --matching         select matching melody algorithm\n"
+           "       -r      --rank-size        number of songs in the rank\n"
+           "       -j      --threads          number of threads scanning the database\n"
+           "       -e      --deadline-ms      stop scanning after this time, the rank is partial\n"
+           "       -p      --prune            skip songs that cannot reach the rank, in practice only with cdtw\n"
+           "       -x      --simd             use the vectorized kernels\n"
+           "       -c      --check            check the vectorized kernels and the cascade against exact ones\n"
+           "       -w      --band             slack in notes of the cdtw band, a constraint, not a speedup\n"
+           "       -f      --paa              notes averaged by the first cascade step\n"
+           "       -H      --hits             non-overlapping matches of a song per reference\n"
            "       -t      --sim-threshold    set similarity detection threshold\n"
+           "       -s      --server           ask the matching engine listening on this socket\n"
+           "       -M      --metrics          time the stages and count the work, json or prometheus\n"
+           "       -O      --metrics-output   file the metrics are written to, the standard error by default\n"
            "       -v      --verbose          be verbose\n"
            "       -h      --help             display this message\n"
            );
@@ -56,15 +78,32 @@ void usage (FILE * stream, int exit_code)
  */
 int parse_args (int argc, char **argv)
 {
-  const char *options = "hvi:o:m:t";
+  const char *options = "hvi:b:o:m:j:pxt:s:cw:n:k:r:f:l:u:e:M:O:H:";
   int next_option;
   struct option long_options[] = {
     {"help",                  0, NULL, 'h'},
     {"verbose",               0, NULL, 'v'},
     {"input-database",        1, NULL, 'i'},
+    {"binary-database",       1, NULL, 'b'},
+    {"segments",              1, NULL, 'u'},
+    {"index",                 1, NULL, 'n'},
+    {"index-hits",            1, NULL, 'k'},
+    {"lsh",                   1, NULL, 'l'},
     {"output-rank",           1, NULL, 'o'},
     {"matching",              1, NULL, 'm'},
+    {"rank-size",             1, NULL, 'r'},
+    {"threads",               1, NULL, 'j'},
+    {"deadline-ms",           1, NULL, 'e'},
+    {"prune",                 0, NULL, 'p'},
+    {"simd",                  0, NULL, 'x'},
+    {"check",                 0, NULL, 'c'},
+    {"band",                  1, NULL, 'w'},
+    {"paa",                   1, NULL, 'f'},
+    {"hits",                  1, NULL, 'H'},
     {"sim-threshold",         1, NULL, 't'},
+    {"server",                1, NULL, 's'},
+    {"metrics",               1, NULL, 'M'},
+    {"metrics-output",        1, NULL, 'O'},
     {NULL,                    0, NULL, 0}
   };
   
@@ -90,15 +129,69 @@ int parse_args (int argc, char **argv)
       case 'i':
         db_input = optarg;
         break;
+      case 'b':
+        db_binary = optarg;
+        break;
+      case 'u':
+        db_segments = optarg;
+        break;
+      case 'n':
+        db_index = optarg;
+        break;
+      case 'k':
+        index_hits = atoi (optarg);
+        break;
+      case 'l':
+        db_lsh = optarg;
+        break;
       case 'o':
         rank_output = optarg;
         break;
       case 'm':
         matching_method = optarg;
         break;
+      case 'r':
+        rank_size = atoi (optarg);
+        break;
+      case 'j':
+        n_threads = atoi (optarg);
+        break;
+      case 'e':
+        deadline_ms = atof (optarg);
+        break;
+      case 'p':
+        prune = 1;
+        break;
+      case 'x':
+        simd = 1;
+        break;
+      case 'c':
+        validate = 1;
+        break;
+      case 'w':
+        band = atoi (optarg);
+        break;
+      case 'f':
+        paa = atoi (optarg);
+        break;
+      case 'H':
+        max_hits = atoi (optarg);
+        break;
       case 't':
         sim_threshold = atoi (optarg);
         break;
+      case 's':
+        server_socket = optarg;
+        break;
+      case 'M':
+        metrics = 1;
+        count_allocations = 1;
+        metrics_format = optarg;
+        check_metrics_format (metrics_format);
+        break;
+      case 'O':
+        metrics_output = optarg;
+        break;
       case '?':                // unknown options
         usage (stderr, 1);
         break;
@@ -110,116 +203,101 @@ int parse_args (int argc, char **argv)
     }
   } while (next_option != -1);
   
-  if (strcmp (matching_method, "default") != 0 &&
-      strcmp (matching_method, "uds") != 0 &&
-      strcmp (matching_method, "dtw") != 0) {
+  if (strcmp (matching_method, "default") != 0 && find_method (matching_method) == NULL) {
     errmsg ("Error: unknown matching method %s.\n", matching_method);
     exit (1);
   }
+  if (rank_size < 1) {
+    errmsg ("Error: the rank must have at least one song.\n");
+    exit (1);
+  }
+  if (paa < 1) {
+    errmsg ("Error: the cascade must average at least one note.\n");
+    exit (1);
+  }
+  if (max_hits < 1) {
+    errmsg ("Error: a song must be matched at least once per reference.\n");
+    exit (1);
+  }
+  if (db_index != NULL && strcmp (matching_method, "uds") != 0) {
+    errmsg ("Error: the index can only be used with the uds method.\n");
+    exit (1);
+  }
+  if ((db_index != NULL || db_lsh != NULL) && db_segments != NULL) {
+    errmsg ("Error: the index and the lsh tables cannot be used with segments.\n");
+    exit (1);
+  }
+  if (db_lsh != NULL && strcmp (matching_method, "uds") == 0) {
+    errmsg ("Error: the lsh tables can only be used with the dtw methods.\n");
+    exit (1);
+  }
   
   return 0;
 }
 
-bool cmp (pair<int,double> p1, pair<int,double> p2)
-{
-  return p1.second < p2.second;
-}
-
-struct Song {
-  const char* author;
-  const char* title;
-  const char* genre;
-  const char* url;
-  Song(const char* a, const char* t, const char* g, const char* u): author(a), title(t), genre(g), url(u) {}
-};
-
-
 /* Main program */
 
 int main(int argc, char **argv)
 {
   // variables
   vector<int> seq;
-  vector<int> reference_seq;
   vector<pair<int,double> > rank;
-  vector<Song> songs;
-  bool used[50] = {0};
- 
+  Corpus corpus;
+  Index index;
+  Lsh lsh;
+  
   
   // parse command line arguments
   parse_args (argc, argv);
   
-  // read db.xml file
-  XMLDocument doc;
-  doc.LoadFile (db_input);
+  // ask the resident matching engine if there is one
+  if (server_socket != NULL)
+    return query_server (server_socket, humming_input, rank_output);
   
   // read humming sequence
-  read_stream (humming_input, seq);
-
-  XMLElement *song = doc.RootElement()->FirstChildElement("song");
-  // loop for each song
-  do
   {
-    verbmsg ("%s %s\n", song->Name (), song->Attribute("id"));
-    XMLElement *sample = song->FirstChildElement("samples")->FirstChildElement("sample");
-    songs.push_back (Song(song->FirstChildElement("author")->GetText(),
-                          song->FirstChildElement("title")->GetText(),
-                          song->FirstChildElement("genre")->GetText(),
-                          song->FirstChildElement("thumb_url")->GetText()));
-    // loop for each sample
-    do
-    {
-      verbmsg ("%s %s\n", sample->Name (), sample->Attribute("path"));
-      char path[80] = "../../";
-      strcat(path, sample->Attribute("path"));
-      
-      // read song sequence
-      read_stream (path, reference_seq);
-      // initialize process
-      verbmsg ("'%s' analizando...\n", path);
-      matching (seq, reference_seq, atoi (song->Attribute("id")), rank);
-      verbmsg ("..fin de la cancion\n\n");
-    } while ((sample=sample->NextSiblingElement("sample")) != NULL);
-  } while ((song=song->NextSiblingElement("song")) != NULL);
+    StageTimer timer (STAGE_QUERY);
+    read_stream (humming_input, seq);
+  }
+  // the default method converts nothing and ranks no song
+  if (seq.empty () && find_method (matching_method) != NULL) {
+    errmsg ("Error: humming input file '%s' has no notes\n", humming_input);
+    exit (1);
+  }
   
+  // read db.xml file and every song sequence, or the live segments
+  if (db_segments != NULL) {
+    Segments m;
+    read_segments (db_segments, m, false);
+    load_segments (m, corpus);
+  } else {
+    if (db_binary != NULL) map_corpus (db_binary, corpus);
+    load_corpus (db_input, corpus);
+  }
+  if (db_index != NULL) map_index (db_index, corpus, index);
+  if (db_lsh != NULL) map_lsh (db_lsh, corpus, lsh);
   
-  sort (rank.begin (), rank.end (), cmp);
+  // initialize process
+  if (db_index != NULL) filter_corpus (seq, corpus, index);
+  if (db_lsh != NULL) filter_corpus_lsh (seq, corpus, lsh);
+  match_corpus (seq, corpus, rank);
+  if (prune) print_pruning (prune_stats);
+  if (validate) print_validation ();
   
   // save the result
-  XMLDocument xmlDoc;
-  XMLNode *pRoot = xmlDoc.NewElement("rank");
-  
-  int max = 5, n = 0;
-  for (int i = 0; n < max && i < rank.size (); i++) {
-    int id = rank[i].first - 1;
-    if (!used[id]) {
-      //verbmsg ("%d: %lf\n", id, rank[i].second);
-      used[id] = true;
-      n++;
-      XMLNode *so = xmlDoc.NewElement("song");
-      XMLElement *auth = xmlDoc.NewElement("author");
-      auth->SetText(songs[rank[i].first - 1].author);
-      so->InsertEndChild(auth);
-      XMLElement *tit = xmlDoc.NewElement("title");
-      tit->SetText(songs[rank[i].first - 1].title);
-      so->InsertEndChild(tit);
-      XMLElement *gen = xmlDoc.NewElement("genre");
-      gen->SetText(songs[rank[i].first - 1].genre);
-      so->InsertEndChild(gen);
-      XMLElement *u = xmlDoc.NewElement("thumb_url");
-      u->SetText(songs[rank[i].first - 1].url);
-      so->InsertEndChild(u);
-      pRoot->InsertEndChild(so);
-      XMLElement *sim = xmlDoc.NewElement("similarity");
-      sim->SetText(rank[i].second);
-      so->InsertEndChild(sim);
-    }
+  FILE *out = stdout;
+  if (rank_output != NULL && (out = fopen (rank_output, "w")) == NULL) {
+    errmsg ("Error: could not open rank output file '%s'\n", rank_output);
+    exit (1);
+  }
+  save_rank (rank, corpus, out);
+  if (out != stdout) fclose (out);
+
+  if (metrics) {
+    FILE *m = open_metrics ();
+    print_metrics (m, run_metrics);
+    close_metrics (m);
   }
-  
-  xmlDoc.InsertFirstChild(pRoot);
-  if (rank_output == NULL) xmlDoc.SaveFile(stdout);
-  else xmlDoc.SaveFile(rank_output);
   
   return 0;
 }
-
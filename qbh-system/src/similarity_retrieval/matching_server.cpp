@@ -0,0 +1,375 @@
+/*
+ Copyright (C) 2013-2014 Jose Alemany Bordera <joalbor1@inf.upv.es>
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "utils.h"
+#include "corpus.h"
+#include "segments.h"
+#include "index.h"
+#include "lsh.h"
+#include "cache.h"
+#include "server.h"
+
+
+/* Functions */
+
+/**
+ * @brief Shows how the program is used.
+ *
+ * Shows how the program is used and the allowed options.
+ * After running, the program finishes execution.
+ *
+ * @param stream Pointer to a FILE object that identifies an output stream.
+ * @param exit_code Status code.
+ *                  If this is 0 or EXIT_SUCCESS, it indicates success.
+ *                  If it is EXIT_FAILURE, it indicates failure.
+ */
+void usage (FILE * stream, int exit_code)
+{
+  fprintf (stream, "usage: %s socket [ options ] \n", prog_name);
+  fprintf (stream,
+           "       -i      --input-database   xml file database\n"
+           "       -b      --binary-database  binary corpus file built by build_corpus\n"
+           "       -u      --segments         segment manifest written by update_corpus\n"
+           "       -n      --index            only match the uds windows found in this index\n"
+           "       -l      --lsh              only match the dtw windows found in these lsh tables\n"
+           "       -k      --index-hits       index hits a window needs to be matched\n"
+           "       -m      --matching         select matching melody algorithm\n"
+           "       -r      --rank-size        number of songs in the rank\n"
+           "       -j      --threads          number of threads scanning the database\n"
+           "       -e      --deadline-ms      stop scanning after this time, the rank is partial\n"
+           "       -q      --cache            number of ranks kept for repeated queries\n"
+           "       -d      --shard            only load shard k/n, the songs whose id %% n is k\n"
+           "       -p      --prune            skip songs that cannot reach the rank, in practice only with cdtw\n"
+           "       -x      --simd             use the vectorized kernels\n"
+           "       -c      --check            check the vectorized kernels and the cascade against exact ones\n"
+           "       -w      --band             slack in notes of the cdtw band, a constraint, not a speedup\n"
+           "       -f      --paa              notes averaged by the first cascade step\n"
+           "       -H      --hits             non-overlapping matches of a song per reference\n"
+           "       -M      --metrics          histograms of the stages of every query, json or prometheus\n"
+           "       -O      --metrics-output   file rewritten with the metrics after each query\n"
+           "       -v      --verbose          be verbose\n"
+           "       -h      --help             display this message\n"
+           );
+  exit (exit_code);
+}
+
+/**
+ * @brief Parses command line arguments.
+ *
+ * Parses command line arguments and detects misuse.
+ *
+ * @param argc Number of arguments received by command line.
+ * @param argv Arguments received by command line.
+ */
+int parse_args (int argc, char **argv)
+{
+  const char *options = "hvi:b:m:j:pxcw:n:k:r:f:l:d:u:q:e:M:O:H:";
+  int next_option;
+  struct option long_options[] = {
+    {"help",                  0, NULL, 'h'},
+    {"verbose",               0, NULL, 'v'},
+    {"input-database",        1, NULL, 'i'},
+    {"binary-database",       1, NULL, 'b'},
+    {"segments",              1, NULL, 'u'},
+    {"index",                 1, NULL, 'n'},
+    {"index-hits",            1, NULL, 'k'},
+    {"lsh",                   1, NULL, 'l'},
+    {"matching",              1, NULL, 'm'},
+    {"rank-size",             1, NULL, 'r'},
+    {"threads",               1, NULL, 'j'},
+    {"deadline-ms",           1, NULL, 'e'},
+    {"cache",                 1, NULL, 'q'},
+    {"shard",                 1, NULL, 'd'},
+    {"prune",                 0, NULL, 'p'},
+    {"simd",                  0, NULL, 'x'},
+    {"check",                 0, NULL, 'c'},
+    {"band",                  1, NULL, 'w'},
+    {"paa",                   1, NULL, 'f'},
+    {"hits",                  1, NULL, 'H'},
+    {"metrics",               1, NULL, 'M'},
+    {"metrics-output",        1, NULL, 'O'},
+    {NULL,                    0, NULL, 0}
+  };
+
+  prog_name = argv[0];
+
+  // if required parameters are not received
+  if (argc < 2) {
+    usage (stderr, 1);
+    return -1;
+  }
+
+  server_socket = argv[1];
+
+  do {
+    next_option = getopt_long (argc, argv, options, long_options, NULL);
+    switch (next_option) {
+      case 'h':                // help
+        usage (stdout, 0);
+        return -1;
+      case 'v':                // verbose
+        verbose = 1;
+        break;
+      case 'i':
+        db_input = optarg;
+        break;
+      case 'b':
+        db_binary = optarg;
+        break;
+      case 'u':
+        db_segments = optarg;
+        break;
+      case 'n':
+        db_index = optarg;
+        break;
+      case 'k':
+        index_hits = atoi (optarg);
+        break;
+      case 'l':
+        db_lsh = optarg;
+        break;
+      case 'm':
+        matching_method = optarg;
+        break;
+      case 'r':
+        rank_size = atoi (optarg);
+        break;
+      case 'j':
+        n_threads = atoi (optarg);
+        break;
+      case 'e':
+        deadline_ms = atof (optarg);
+        break;
+      case 'q':
+        cache_size = atoi (optarg);
+        break;
+      case 'd':
+        if (sscanf (optarg, "%d/%d", &shard, &n_shards) != 2 ||
+            n_shards < 1 || shard < 0 || shard >= n_shards) {
+          errmsg ("Error: shard must be k/n with 0 <= k < n.\n");
+          exit (1);
+        }
+        break;
+      case 'p':
+        prune = 1;
+        break;
+      case 'x':
+        simd = 1;
+        break;
+      case 'c':
+        validate = 1;
+        break;
+      case 'w':
+        band = atoi (optarg);
+        break;
+      case 'f':
+        paa = atoi (optarg);
+        break;
+      case 'H':
+        max_hits = atoi (optarg);
+        break;
+      case 'M':
+        metrics = 1;
+        count_allocations = 1;
+        metrics_format = optarg;
+        check_metrics_format (metrics_format);
+        break;
+      case 'O':
+        metrics_output = optarg;
+        break;
+      case '?':                // unknown options
+        usage (stderr, 1);
+        break;
+      case -1:                 // done with options
+        break;
+      default:                 // something else unexpected
+        fprintf (stderr, "Error parsing option '%c'\n", next_option);
+        abort ();
+    }
+  } while (next_option != -1);
+
+  if (find_method (matching_method) == NULL) {
+    errmsg ("Error: unknown matching method %s.\n", matching_method);
+    exit (1);
+  }
+  if (rank_size < 1) {
+    errmsg ("Error: the rank must have at least one song.\n");
+    exit (1);
+  }
+  if (paa < 1) {
+    errmsg ("Error: the cascade must average at least one note.\n");
+    exit (1);
+  }
+  if (max_hits < 1) {
+    errmsg ("Error: a song must be matched at least once per reference.\n");
+    exit (1);
+  }
+  if (db_index != NULL && strcmp (matching_method, "uds") != 0) {
+    errmsg ("Error: the index can only be used with the uds method.\n");
+    exit (1);
+  }
+  if ((db_index != NULL || db_lsh != NULL) && n_shards > 1) {
+    errmsg ("Error: the index and the lsh tables cover the whole database, not a shard.\n");
+    exit (1);
+  }
+  if ((db_index != NULL || db_lsh != NULL) && db_segments != NULL) {
+    errmsg ("Error: the index and the lsh tables cannot be used with segments.\n");
+    exit (1);
+  }
+  if (db_lsh != NULL && strcmp (matching_method, "uds") == 0) {
+    errmsg ("Error: the lsh tables can only be used with the dtw methods.\n");
+    exit (1);
+  }
+
+  return 0;
+}
+
+
+/**
+ * @brief Loads the corpus, and its index or lsh tables, from their files.
+ *
+ * Whatever was loaded before is released first, so the engine can load the
+ * files again when they change.
+ */
+void load_database (Corpus &corpus, Index &index, Lsh &lsh)
+{
+  if (corpus.map != NULL) munmap (corpus.map, corpus.map_size);
+  if (index.map != NULL) munmap (index.map, index.map_size);
+  if (lsh.map != NULL) munmap (lsh.map, lsh.map_size);
+  corpus = Corpus ();
+  index = Index ();
+  lsh = Lsh ();
+
+  // read db.xml file and every song sequence, or the live segments, once
+  if (db_segments != NULL) {
+    Segments m;
+    read_segments (db_segments, m, false);
+    load_segments (m, corpus);
+  } else {
+    if (db_binary != NULL) map_corpus (db_binary, corpus);
+    load_corpus (db_input, corpus);
+  }
+  if (db_index != NULL) map_index (db_index, corpus, index);
+  if (db_lsh != NULL) map_lsh (db_lsh, corpus, lsh);
+  verbmsg ("%lu songs loaded\n", corpus.songs.size ());
+}
+
+/**
+ * @brief Writes the rank of a query into a string.
+ */
+void rank_xml (vector<pair<int,double> > &rank, Corpus &corpus, string &xml)
+{
+  char *buf = NULL;
+  size_t size = 0;
+  FILE *out = open_memstream (&buf, &size);
+  save_rank (rank, corpus, out);
+  fclose (out);
+  xml.assign (buf, size);
+  free (buf);
+}
+
+
+/* Main program */
+
+int main(int argc, char **argv)
+{
+  // variables
+  vector<int> seq;
+  vector<pair<int,double> > rank;
+  Corpus corpus;
+  Index index;
+  Lsh lsh;
+  RankCache cache;
+  MetricsHistograms hist;
+  string xml;
+  char request[PATH_MAX + 1];
+
+
+  // parse command line arguments
+  parse_args (argc, argv);
+
+  // the files the corpus is loaded from
+  const char *files[] = { db_segments ? db_segments : db_input, db_segments ? NULL : db_binary,
+                          db_index, db_lsh };
+  int n_files = sizeof (files) / sizeof (files[0]);
+
+  cache.stamp = file_stamp (files, n_files);
+  load_database (corpus, index, lsh);
+
+  int fd = listen_server (server_socket);
+
+  // loop for each query
+  for (;;) {
+    int client = accept (fd, NULL, NULL);
+    if (client < 0) continue;
+
+    if (read_request (client, request, sizeof (request)) > 0 && access (request, R_OK) == 0) {
+      verbmsg ("query '%s'\n", request);
+      metrics_reset ();
+      // a corpus changed on disk is loaded again and the cached ranks dropped
+      string stamp = file_stamp (files, n_files);
+      if (stamp != cache.stamp) {
+        verbmsg ("corpus changed, loading it again\n");
+        cache.stamp = stamp;
+        cache_clear (cache);
+        load_database (corpus, index, lsh);
+      }
+
+      {
+        StageTimer timer (STAGE_QUERY);
+        read_stream (request, seq);
+      }
+      string key = query_fingerprint (seq);
+      if (seq.empty () && find_method (matching_method) != NULL) {
+        // nothing to match, the client gets an empty rank
+        errmsg ("Error: humming input file '%s' has no notes\n", request);
+        rank.clear ();
+        rank_xml (rank, corpus, xml);
+      } else if (cache_size < 1 || !cache_find (cache, key, xml)) {
+        rank.clear ();
+        if (db_index != NULL) filter_corpus (seq, corpus, index);
+        if (db_lsh != NULL) filter_corpus_lsh (seq, corpus, lsh);
+        match_corpus (seq, corpus, rank);
+        if (prune) print_pruning (prune_stats);
+        if (validate) print_validation ();
+        rank_xml (rank, corpus, xml);
+        // a rank cut by the deadline is not the one of the query
+        if (scan_visited == corpus.songs.size ()) cache_add (cache, key, xml);
+      }
+      if (cache_size > 0) verbmsg ("cache: %ld hits, %ld misses\n", cache.hits, cache.misses);
+
+      {
+        StageTimer timer (STAGE_OUTPUT);
+        FILE *out = fdopen (client, "w");
+        fwrite (xml.data (), 1, xml.size (), out);
+        fclose (out);
+      }
+      if (metrics) {
+        add_metrics (hist, run_metrics);
+        FILE *m = open_metrics ();
+        print_histograms (m, hist);
+        close_metrics (m);
+      }
+    } else {
+      errmsg ("Error: could not open humming input file '%s'\n", request);
+      close (client);
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,317 @@
+/*
+ Copyright (C) 2013-2014 Jose Alemany Bordera <joalbor1@inf.upv.es>
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+ * Hot path instrumentation.
+ *
+ * A StageTimer charges the time of a scope to a stage. Stages do not
+ * overlap: an inner timer stops the outer one until it ends, so the stage
+ * times of a run add up to the time spent inside timers. Timers are only
+ * used by the main thread.
+ *
+ * The counters are added atomically, the workers scanning the corpus add
+ * to them too. Everything is skipped when metrics is 0, and heap
+ * allocations are only counted when count_allocations is set.
+ *
+ * Self-contained, so that the melody extraction can use it as well.
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <sys/time.h>
+
+enum Stage {
+  STAGE_LOAD,                  // xml database and metadata
+  STAGE_REFERENCES,            // reference note files
+  STAGE_QUERY,                 // humming note file
+  STAGE_FILTER,                // index and lsh windows
+  STAGE_MATCH,                 // dynamic programming over the corpus
+  STAGE_SORT,                  // selection of the best songs
+  STAGE_OUTPUT,                // rank xml or note file
+  STAGE_DECODE,                // audio decoding
+  STAGE_PITCH,                 // onset and pitch detection
+  STAGE_NOTES,                 // note segmentation
+  N_STAGES
+};
+
+const char *stage_names[N_STAGES] = {
+  "load", "references", "query", "filter", "match", "sort", "output", "decode", "pitch", "notes"
+};
+
+struct Metrics {
+  double seconds[N_STAGES];
+  long calls[N_STAGES];
+  long cells;                  // DP cells of the grids scanned, minus the pruned ones
+  long references;             // reference samples scanned
+  long bytes;                  // bytes read from files, mapped files are not counted
+  long allocations;            // heap allocations
+};
+
+// latency buckets of the histograms, in seconds
+const double metric_buckets[] = {
+  0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5
+};
+#define N_BUCKETS (sizeof (metric_buckets) / sizeof (metric_buckets[0]))
+
+struct Histogram {
+  long buckets[N_BUCKETS + 1]; // last one is +Inf, not cumulative
+  long count;
+  double sum;
+};
+
+// metrics of many runs, as kept by the matching engine
+struct MetricsHistograms {
+  Histogram stages[N_STAGES];
+  Histogram total;
+  long queries, cells, references, bytes, allocations;
+  MetricsHistograms () { memset (this, 0, sizeof (*this)); }
+};
+
+// instrumentation enabled
+int metrics = 0;
+int count_allocations = 0;
+// "json" or "prometheus"
+const char * metrics_format = "json";
+// file the metrics are written to, NULL for the standard error
+char * metrics_output = NULL;
+
+Metrics run_metrics;
+int current_stage = -1;
+double stage_start = 0;
+
+
+/* Functions */
+
+/**
+ * @brief Wall clock time in seconds.
+ */
+double now ()
+{
+  struct timeval tv;
+  gettimeofday (&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+void *operator new (size_t size)
+{
+  if (count_allocations) __sync_fetch_and_add (&run_metrics.allocations, 1);
+  void *p = malloc (size ? size : 1);
+  if (p == NULL) throw std::bad_alloc ();
+  return p;
+}
+
+void operator delete (void *p)
+{
+  free (p);
+}
+
+void metric_add (long &counter, long n)
+{
+  if (metrics) __sync_fetch_and_add (&counter, n);
+}
+
+void metrics_reset ()
+{
+  memset (&run_metrics, 0, sizeof (run_metrics));
+  current_stage = -1;
+}
+
+struct StageTimer {
+  int stage, outer;
+  StageTimer (int s) : stage(s), outer(-1)
+  {
+    if (!metrics) return;
+    double t = now ();
+    if (current_stage >= 0) run_metrics.seconds[current_stage] += t - stage_start;
+    outer = current_stage;
+    current_stage = stage;
+    stage_start = t;
+  }
+  ~StageTimer ()
+  {
+    if (!metrics) return;
+    double t = now ();
+    run_metrics.seconds[stage] += t - stage_start;
+    run_metrics.calls[stage]++;
+    current_stage = outer;
+    stage_start = t;
+  }
+};
+
+/**
+ * @brief Checks the metrics format given by command line.
+ */
+void check_metrics_format (const char *format)
+{
+  if (strcmp (format, "json") != 0 && strcmp (format, "prometheus") != 0) {
+    fprintf (stderr, "Error: unknown metrics format %s.\n", format);
+    exit (1);
+  }
+}
+
+/**
+ * @brief Writes the metrics of a run.
+ *
+ * Only the stages that ran are written.
+ *
+ * @param stream Pointer to a FILE object that identifies an output stream.
+ * @param m Metrics of the run.
+ */
+void print_metrics (FILE *stream, Metrics &m)
+{
+  bool json = (strcmp (metrics_format, "json") == 0);
+
+  if (json) {
+    fprintf (stream, "{\"stages\": {");
+    for (int s = 0, n = 0; s < N_STAGES; s++) {
+      if (m.calls[s] == 0) continue;
+      fprintf (stream, "%s\"%s\": {\"seconds\": %.6f, \"calls\": %ld}", n++ ? ", " : "",
+               stage_names[s], m.seconds[s], m.calls[s]);
+    }
+    fprintf (stream, "}, \"dp_cells\": %ld, \"references\": %ld, \"bytes_read\": %ld, \"allocations\": %ld}\n",
+             m.cells, m.references, m.bytes, m.allocations);
+    return;
+  }
+
+  fprintf (stream, "# TYPE qbh_stage_seconds gauge\n");
+  for (int s = 0; s < N_STAGES; s++)
+    if (m.calls[s] > 0)
+      fprintf (stream, "qbh_stage_seconds{stage=\"%s\"} %.6f\n", stage_names[s], m.seconds[s]);
+  fprintf (stream, "# TYPE qbh_dp_cells_total counter\nqbh_dp_cells_total %ld\n", m.cells);
+  fprintf (stream, "# TYPE qbh_references_total counter\nqbh_references_total %ld\n", m.references);
+  fprintf (stream, "# TYPE qbh_read_bytes_total counter\nqbh_read_bytes_total %ld\n", m.bytes);
+  fprintf (stream, "# TYPE qbh_allocations_total counter\nqbh_allocations_total %ld\n", m.allocations);
+}
+
+void observe (Histogram &h, double seconds)
+{
+  int b = 0;
+  while (b < N_BUCKETS && seconds > metric_buckets[b]) b++;
+  h.buckets[b]++;
+  h.count++;
+  h.sum += seconds;
+}
+
+/**
+ * @brief Adds the metrics of a run to the histograms.
+ *
+ * @param hist Histograms of the previous runs.
+ * @param m Metrics of the run.
+ */
+void add_metrics (MetricsHistograms &hist, Metrics &m)
+{
+  double total = 0;
+  for (int s = 0; s < N_STAGES; s++) {
+    if (m.calls[s] == 0) continue;
+    observe (hist.stages[s], m.seconds[s]);
+    total += m.seconds[s];
+  }
+  observe (hist.total, total);
+  hist.queries++;
+  hist.cells += m.cells;
+  hist.references += m.references;
+  hist.bytes += m.bytes;
+  hist.allocations += m.allocations;
+}
+
+void print_histogram (FILE *stream, bool json, const char *name, const char *stage, Histogram &h)
+{
+  long n = 0;
+  if (json) {
+    fprintf (stream, "\"%s\": {\"count\": %ld, \"sum\": %.6f, \"buckets\": [", stage, h.count, h.sum);
+    for (int b = 0; b < N_BUCKETS; b++)
+      fprintf (stream, "[%g, %ld], ", metric_buckets[b], n += h.buckets[b]);
+    fprintf (stream, "[\"+Inf\", %ld]]}", h.count);
+    return;
+  }
+  for (int b = 0; b < N_BUCKETS; b++)
+    fprintf (stream, "%s_bucket{%s%s%sle=\"%g\"} %ld\n", name, stage ? "stage=\"" : "",
+             stage ? stage : "", stage ? "\"," : "", metric_buckets[b], n += h.buckets[b]);
+  fprintf (stream, "%s_bucket{%s%s%sle=\"+Inf\"} %ld\n", name, stage ? "stage=\"" : "",
+           stage ? stage : "", stage ? "\"," : "", h.count);
+  fprintf (stream, "%s_sum%s%s%s %.6f\n", name, stage ? "{stage=\"" : "", stage ? stage : "",
+           stage ? "\"}" : "", h.sum);
+  fprintf (stream, "%s_count%s%s%s %ld\n", name, stage ? "{stage=\"" : "", stage ? stage : "",
+           stage ? "\"}" : "", h.count);
+}
+
+/**
+ * @brief Writes the histograms of every run.
+ *
+ * @param stream Pointer to a FILE object that identifies an output stream.
+ * @param hist Histograms of the runs.
+ */
+void print_histograms (FILE *stream, MetricsHistograms &hist)
+{
+  bool json = (strcmp (metrics_format, "json") == 0);
+
+  if (json) {
+    fprintf (stream, "{\"queries\": %ld, \"stages\": {", hist.queries);
+    for (int s = 0, n = 0; s < N_STAGES; s++) {
+      if (hist.stages[s].count == 0) continue;
+      if (n++) fprintf (stream, ", ");
+      print_histogram (stream, json, NULL, stage_names[s], hist.stages[s]);
+    }
+    fprintf (stream, "}, ");
+    print_histogram (stream, json, NULL, "total", hist.total);
+    fprintf (stream, ", \"dp_cells\": %ld, \"references\": %ld, \"bytes_read\": %ld, \"allocations\": %ld}\n",
+             hist.cells, hist.references, hist.bytes, hist.allocations);
+    return;
+  }
+
+  fprintf (stream, "# TYPE qbh_stage_seconds histogram\n");
+  for (int s = 0; s < N_STAGES; s++)
+    if (hist.stages[s].count > 0)
+      print_histogram (stream, json, "qbh_stage_seconds", stage_names[s], hist.stages[s]);
+  fprintf (stream, "# TYPE qbh_query_seconds histogram\n");
+  print_histogram (stream, json, "qbh_query_seconds", NULL, hist.total);
+  fprintf (stream, "# TYPE qbh_queries_total counter\nqbh_queries_total %ld\n", hist.queries);
+  fprintf (stream, "# TYPE qbh_dp_cells_total counter\nqbh_dp_cells_total %ld\n", hist.cells);
+  fprintf (stream, "# TYPE qbh_references_total counter\nqbh_references_total %ld\n", hist.references);
+  fprintf (stream, "# TYPE qbh_read_bytes_total counter\nqbh_read_bytes_total %ld\n", hist.bytes);
+  fprintf (stream, "# TYPE qbh_allocations_total counter\nqbh_allocations_total %ld\n", hist.allocations);
+}
+
+/**
+ * @brief Opens the stream the metrics are written to.
+ *
+ * A file is written under a temporary name and close_metrics renames it,
+ * so that readers never see it half written.
+ */
+FILE *open_metrics ()
+{
+  if (metrics_output == NULL) return stderr;
+  char tmp[4096];
+  snprintf (tmp, sizeof (tmp), "%s.tmp", metrics_output);
+  FILE *out = fopen (tmp, "w");
+  if (out == NULL) {
+    fprintf (stderr, "Error: could not open metrics output file '%s'\n", tmp);
+    exit (1);
+  }
+  return out;
+}
+
+void close_metrics (FILE *out)
+{
+  if (out == stderr) return;
+  char tmp[4096];
+  snprintf (tmp, sizeof (tmp), "%s.tmp", metrics_output);
+  fclose (out);
+  rename (tmp, metrics_output);
+}
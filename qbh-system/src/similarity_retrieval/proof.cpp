@@ -1,27 +1,64 @@
 /*
  Copyright (C) 2013-2014 Jose Alemany Bordera <joalbor1@inf.upv.es>
- 
+
  This program is free software: you can redistribute it and/or modify
  it under the terms of the GNU General Public License as published by
  the Free Software Foundation, either version 3 of the License, or
  (at your option) any later version.
- 
+
  This program is distributed in the hope that it will be useful,
  but WITHOUT ANY WARRANTY; without even the implied warranty of
  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
  GNU General Public License for more details.
- 
+
  You should have received a copy of the GNU General Public License
  along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 */
 
 #include "utils.h"
+#include "corpus.h"
+#include "segments.h"
 
 
 char * humming_input1 = NULL;
 char * humming_input2 = NULL;
 
+// matching modes of the evaluation, the first one is the baseline
+const char * eval_modes = "dtw";
+int queries_per_song = 1;
+// voiced notes of the reference cropped for each query
+int crop_notes = 20;
+// largest transposition, in semitones
+int max_transpose = 5;
+// largest change of tempo, as a fraction
+double max_stretch = 0.2;
+// probability of inserting a note after each note, and of deleting it
+double insert_rate = 0.05;
+double delete_rate = 0.05;
+unsigned int seed = 1;
+
+struct Note {
+  double onset, duration, pitch;
+};
+
+struct EvalQuery {
+  int song;                    // position in the corpus of the song the query was taken from
+  string notes;                // note file of the query
+};
+
+struct Mode {
+  string name;
+  const char *method;
+  int simd, prune;
+};
+
+struct Outcome {
+  int position;                // position of the song in the rank, 0 if missing
+  int first;                   // position of the first song of the rank, -1 if empty
+  double ms;
+};
+
 
 /* Functions */
 
@@ -39,17 +76,68 @@ char * humming_input2 = NULL;
 void usage (FILE * stream, int exit_code)
 {
   fprintf (stream, "usage: %s humming_input1 humming_input2 \n", prog_name);
+  fprintf (stream, "       %s [ options ] \n", prog_name);
   fprintf (stream,
            "       -i      --input-database   xml file database\n"
-           "       -o      --output-rank      output xml file with the rank list\n"
-           "       -m      --matching         select matching melody algorithm\n"
+           "       -b      --binary-database  binary corpus file built by build_corpus\n"
+           "       -u      --segments         segment manifest written by update_corpus\n"
+           "       -o      --output-rank      output file with the result of every query\n"
+           "       -m      --matching         select matching melody algorithm, or the\n"
+           "                                  comma separated modes to evaluate\n"
            "       -t      --sim-threshold    set similarity detection threshold\n"
+           "       -r      --rank-size        hits within this position count as top hits\n"
+           "       -j      --threads          threads scanning the corpus\n"
+           "       -n      --queries          queries taken from each song\n"
+           "       -c      --crop             voiced notes of each query\n"
+           "       -k      --transpose        largest transposition, in semitones\n"
+           "       -s      --stretch          largest change of tempo, as a fraction\n"
+           "       -a      --insertions       probability of inserting a note\n"
+           "       -d      --deletions        probability of deleting a note\n"
+           "       -z      --seed             seed of the query generator\n"
            "       -v      --verbose          be verbose\n"
            "       -h      --help             display this message\n"
+           "\n"
+           "With two hummings, the first one is matched against the second one.\n"
+           "Otherwise the queries are taken from the reference files of the database,\n"
+           "and each mode is evaluated on all of them. A mode is a matching method\n"
+           "followed by +simd and +prune as wanted, such as dtw,cascade+simd+prune.\n"
            );
   exit (exit_code);
 }
 
+/**
+ * @brief Reads a matching mode.
+ *
+ * @param name Method name and options, like cascade+simd.
+ * @param mode Mode object where the mode is stored.
+ */
+void parse_mode (const string &name, Mode &mode)
+{
+  static const char *methods[] = { "dtw", "cdtw", "cascade", "uds" };
+  string method = name.substr (0, name.find ('+'));
+
+  mode.name = name;
+  mode.method = NULL;
+  mode.simd = mode.prune = 0;
+  for (int k = 0; k < 4; k++)
+    if (method == methods[k]) mode.method = methods[k];
+  if (mode.method == NULL) {
+    errmsg ("Error: unknown matching method %s.\n", method.c_str ());
+    exit (1);
+  }
+  for (size_t k = name.find ('+'); k != string::npos; k = name.find ('+', k + 1)) {
+    string option = name.substr (k + 1, name.find ('+', k + 1) - k - 1);
+    if (option == "simd" && strcmp (mode.method, "cdtw") != 0)
+      mode.simd = 1;
+    else if (option == "prune")
+      mode.prune = 1;
+    else {
+      errmsg ("Error: unknown option %s of matching mode %s.\n", option.c_str (), name.c_str ());
+      exit (1);
+    }
+  }
+}
+
 /**
  * @brief Parses command line arguments.
  *
@@ -60,29 +148,31 @@ void usage (FILE * stream, int exit_code)
  */
 int parse_args (int argc, char **argv)
 {
-  const char *options = "hvi:o:m:t";
+  const char *options = "hvi:b:u:o:m:t:r:j:n:c:k:s:a:d:z:";
   int next_option;
   struct option long_options[] = {
     {"help",                  0, NULL, 'h'},
     {"verbose",               0, NULL, 'v'},
     {"input-database",        1, NULL, 'i'},
+    {"binary-database",       1, NULL, 'b'},
+    {"segments",              1, NULL, 'u'},
     {"output-rank",           1, NULL, 'o'},
     {"matching",              1, NULL, 'm'},
     {"sim-threshold",         1, NULL, 't'},
+    {"rank-size",             1, NULL, 'r'},
+    {"threads",               1, NULL, 'j'},
+    {"queries",               1, NULL, 'n'},
+    {"crop",                  1, NULL, 'c'},
+    {"transpose",             1, NULL, 'k'},
+    {"stretch",               1, NULL, 's'},
+    {"insertions",            1, NULL, 'a'},
+    {"deletions",             1, NULL, 'd'},
+    {"seed",                  1, NULL, 'z'},
     {NULL,                    0, NULL, 0}
   };
-  
+
   prog_name = argv[0];
-  
-  // if required parameters are not received
-  if (argc < 2) {
-    usage (stderr, 1);
-    return -1;
-  }
-  
-  humming_input1 = argv[1];
-  humming_input2 = argv[2];
-  
+
   do {
     next_option = getopt_long (argc, argv, options, long_options, NULL);
     switch (next_option) {
@@ -95,15 +185,49 @@ int parse_args (int argc, char **argv)
       case 'i':
         db_input = optarg;
         break;
+      case 'b':
+        db_binary = optarg;
+        break;
+      case 'u':
+        db_segments = optarg;
+        break;
       case 'o':
         rank_output = optarg;
         break;
       case 'm':
         matching_method = optarg;
+        eval_modes = optarg;
         break;
       case 't':
         sim_threshold = atoi (optarg);
         break;
+      case 'r':
+        rank_size = atoi (optarg);
+        break;
+      case 'j':
+        n_threads = atoi (optarg);
+        break;
+      case 'n':
+        queries_per_song = atoi (optarg);
+        break;
+      case 'c':
+        crop_notes = atoi (optarg);
+        break;
+      case 'k':
+        max_transpose = atoi (optarg);
+        break;
+      case 's':
+        max_stretch = atof (optarg);
+        break;
+      case 'a':
+        insert_rate = atof (optarg);
+        break;
+      case 'd':
+        delete_rate = atof (optarg);
+        break;
+      case 'z':
+        seed = atoi (optarg);
+        break;
       case '?':                // unknown options
         usage (stderr, 1);
         break;
@@ -114,17 +238,301 @@ int parse_args (int argc, char **argv)
         abort ();
     }
   } while (next_option != -1);
-  
-  if (strcmp (matching_method, "default") != 0 &&
-      strcmp (matching_method, "uds") != 0 &&
-      strcmp (matching_method, "dtw") != 0) {
+
+  if (argc - optind == 2) {
+    humming_input1 = argv[optind];
+    humming_input2 = argv[optind + 1];
+  } else if (argc - optind != 0) {
+    usage (stderr, 1);
+    return -1;
+  }
+
+  if (humming_input1 != NULL &&
+      strcmp (matching_method, "default") != 0 && find_method (matching_method) == NULL) {
     errmsg ("Error: unknown matching method %s.\n", matching_method);
     exit (1);
   }
-  
+  if (rank_size < 1 || n_threads < 1 || queries_per_song < 1 || crop_notes < 2 ||
+      max_transpose < 0 || max_stretch < 0 || max_stretch >= 1 ||
+      insert_rate < 0 || delete_rate < 0 || delete_rate >= 1) {
+    errmsg ("Error: bad evaluation parameters.\n");
+    exit (1);
+  }
+
+  return 0;
+}
+
+/**
+ * @brief Reads a note file as written by the melody extraction.
+ *
+ * @param path Path of the note file.
+ * @param notes Vector where the notes, rests included, are stored.
+ */
+void read_notes (const char *path, vector<Note> &notes)
+{
+  FILE *in = fopen (path, "r");
+  if (in == NULL) {
+    errmsg ("Error: could not open reference file '%s'\n", path);
+    exit (1);
+  }
+  Note n;
+  notes.clear ();
+  while (fscanf (in, "%lf %lf %lf", &n.onset, &n.duration, &n.pitch) == 3)
+    notes.push_back (n);
+  fclose (in);
+}
+
+void append_note (string &text, const Note &n)
+{
+  char line[96];
+  sprintf (line, "%f\t%f\t%g\n", n.onset, n.duration, n.pitch);
+  text += line;
+}
+
+double uniform ()
+{
+  return rand () / (RAND_MAX + 1.0);
+}
+
+/**
+ * @brief Hums a reference badly.
+ *
+ * A segment of crop_notes voiced notes is cropped, transposed and played at
+ * another tempo, and some notes are dropped or followed by a short passing
+ * note a semitone or two away.
+ *
+ * @param ref Notes of the reference.
+ * @param text String where the note file of the query is stored.
+ * @return Whether the reference has any voiced note.
+ */
+bool perturb_notes (const vector<Note> &ref, string &text)
+{
+  vector<int> voiced;
+  for (int i = 0; i < ref.size (); i++)
+    if (ref[i].pitch) voiced.push_back (i);
+  if (voiced.empty ()) return false;
+
+  int size = min (crop_notes, (int) voiced.size ());
+  int k = rand () % (voiced.size () - size + 1);
+  int first = voiced[k], last = voiced[k + size - 1];
+  int key = rand () % (2 * max_transpose + 1) - max_transpose;
+  double tempo = 1 + max_stretch * (2 * uniform () - 1);
+
+  text.clear ();
+  for (int i = first; i <= last; i++) {
+    Note n = ref[i];
+    n.onset = (n.onset - ref[first].onset) * tempo;
+    n.duration *= tempo;
+    if (n.pitch) {
+      if (uniform () < delete_rate) continue;
+      n.pitch += key;
+    }
+    append_note (text, n);
+    if (n.pitch && uniform () < insert_rate) {
+      Note e = n;
+      e.onset += n.duration / 2;
+      e.duration = n.duration / 2;
+      e.pitch += ((rand () % 2) ? 1 : -1) * (1 + rand () % 2);
+      append_note (text, e);
+    }
+  }
+  return true;
+}
+
+/**
+ * @brief Takes the queries of the evaluation from the reference files.
+ *
+ * @param corpus Corpus with the songs and the paths of their samples.
+ * @param queries Vector where the queries are stored.
+ */
+void generate_queries (Corpus &corpus, vector<EvalQuery> &queries)
+{
+  vector<Note> ref;
+
+  srand (seed);
+  queries.clear ();
+  for (int i = 0; i < corpus.songs.size (); i++) {
+    Song &song = corpus.songs[i];
+    if (song.samples.empty ()) continue;
+    for (int k = 0; k < queries_per_song; k++) {
+      EvalQuery q;
+      q.song = i;
+      Sample &sa = song.samples[rand () % song.samples.size ()];
+      read_notes ((string (db_root) + text (corpus, sa.path)).c_str (), ref);
+      if (perturb_notes (ref, q.notes)) queries.push_back (q);
+    }
+  }
+}
+
+/**
+ * @brief Converts the note file of a query with the current matching method.
+ */
+void convert_query (const EvalQuery &q, vector<int> &seq)
+{
+  FILE *in = fmemopen ((void *) q.notes.c_str (), q.notes.size (), "r");
+  seq.clear ();
+  find_method (matching_method)->convert (in, seq);
+  fclose (in);
+}
+
+/**
+ * @brief Position of a song among the different songs of a rank.
+ *
+ * @param rank Rank list with <song, similarity> pairs, sorted on return.
+ * @param song Position of the song in the corpus.
+ * @param n_songs Number of songs of the corpus.
+ * @param first Where the first song is stored, -1 if the rank is empty.
+ * @return Position of the song starting at 1, 0 if it is not in the rank.
+ */
+int song_position (vector<pair<int,double> > &rank, int song, int n_songs, int &first)
+{
+  vector<bool> seen (n_songs, false);
+
+  sort (rank.begin (), rank.end (), cmp);
+  first = rank.empty () ? -1 : rank[0].first;
+  for (int k = 0, n = 0; k < rank.size (); k++) {
+    if (seen[rank[k].first]) continue;
+    seen[rank[k].first] = true;
+    n++;
+    if (rank[k].first == song) return n;
+  }
   return 0;
 }
 
+/**
+ * @brief Runs every query of the evaluation with a matching mode.
+ *
+ * A first query grows the scratch buffers and is not timed.
+ *
+ * @param mode Matching mode, already set in the globals.
+ * @param queries Queries of the evaluation.
+ * @param corpus Corpus converted with the method of the mode.
+ * @param outcomes Vector where the result of every query is stored.
+ */
+void evaluate_mode (Mode &mode, vector<EvalQuery> &queries, Corpus &corpus, vector<Outcome> &outcomes)
+{
+  vector<int> seq;
+  vector<pair<int,double> > rank;
+
+  outcomes.resize (queries.size ());
+  for (int k = -1; k < (int) queries.size (); k++) {
+    Outcome o;
+    convert_query (queries[max (k, 0)], seq);
+    rank.clear ();
+    double t = now ();
+    if (!seq.empty ()) match_corpus (seq, corpus, rank);
+    o.ms = (now () - t) * 1e3;
+    o.position = song_position (rank, queries[max (k, 0)].song, corpus.songs.size (), o.first);
+    if (k >= 0) outcomes[k] = o;
+  }
+}
+
+/**
+ * @brief Shows the hit rates, the MRR and the latency of a mode.
+ *
+ * @param mode Matching mode.
+ * @param outcomes Result of every query.
+ * @param baseline Result of every query with the baseline mode.
+ */
+void print_summary (Mode &mode, vector<Outcome> &outcomes, vector<Outcome> &baseline)
+{
+  int top1 = 0, top_k = 0, agree = 0;
+  double mrr = 0, total = 0;
+  vector<double> latency;
+
+  for (int k = 0; k < outcomes.size (); k++) {
+    Outcome &o = outcomes[k];
+    if (o.position == 1) top1++;
+    if (o.position >= 1 && o.position <= rank_size) top_k++;
+    if (o.position > 0) mrr += 1.0 / o.position;
+    if (o.first == baseline[k].first) agree++;
+    total += o.ms;
+    latency.push_back (o.ms);
+  }
+  sort (latency.begin (), latency.end ());
+  int n = max (1, (int) outcomes.size ());
+  outmsg ("%-24s %7lu %7.3f %7.3f %7.3f %7.3f %9.3f %9.3f %9.3f\n", mode.name.c_str (),
+          outcomes.size (), (double) top1 / n, (double) top_k / n, mrr / n,
+          (double) agree / n, total / n, latency.empty () ? 0 : percentile (latency, 0.5),
+          latency.empty () ? 0 : percentile (latency, 0.99));
+}
+
+/**
+ * @brief Loads the corpus with the current matching method.
+ */
+void load_method (Corpus &corpus)
+{
+  if (db_segments != NULL) {
+    Segments m;
+    read_segments (db_segments, m, false);
+    load_segments (m, corpus);
+  } else {
+    if (db_binary != NULL) map_corpus (db_binary, corpus);
+    load_corpus (db_input, corpus);
+  }
+}
+
+/**
+ * @brief Evaluates the retrieval of every mode with perturbed references.
+ *
+ * Every mode runs the same queries, and the first one is the baseline the
+ * first song of each rank is compared with.
+ */
+void evaluate ()
+{
+  vector<Mode> modes;
+  vector<EvalQuery> queries;
+  vector<vector<Outcome> > outcomes;
+  // corpora converted to MIDI and to UDS
+  Corpus corpora[2];
+  bool loaded[2] = { false, false };
+
+  string list (eval_modes);
+  for (size_t k = 0; k <= list.size (); ) {
+    size_t end = min (list.find (',', k), list.size ());
+    Mode mode;
+    parse_mode (list.substr (k, end - k), mode);
+    modes.push_back (mode);
+    k = end + 1;
+  }
+
+  FILE *out = NULL;
+  if (rank_output != NULL && (out = fopen (rank_output, "w")) == NULL) {
+    errmsg ("Error: could not open output file '%s'\n", rank_output);
+    exit (1);
+  }
+  if (out != NULL) fprintf (out, "mode\tquery\tsong\tposition\tfirst\tms\n");
+
+  outcomes.resize (modes.size ());
+  for (int m = 0; m < modes.size (); m++) {
+    int c = (strcmp (modes[m].method, "uds") == 0) ? 1 : 0;
+    matching_method = modes[m].method;
+    simd = modes[m].simd;
+    prune = modes[m].prune;
+    if (!loaded[c]) {
+      load_method (corpora[c]);
+      loaded[c] = true;
+    }
+    if (queries.empty ()) {
+      generate_queries (corpora[c], queries);
+      verbmsg ("%lu queries of %d notes from %lu songs\n", queries.size (), crop_notes,
+               corpora[c].songs.size ());
+      outmsg ("%-24s %7s %7s %7s %7s %7s %9s %9s %9s\n", "mode", "queries", "top-1", "top-k",
+              "mrr", "agree", "mean ms", "p50 ms", "p99 ms");
+    }
+    evaluate_mode (modes[m], queries, corpora[c], outcomes[m]);
+    print_summary (modes[m], outcomes[m], outcomes[0]);
+    // the file has the ids of the songs, not their positions
+    vector<Song> &songs = corpora[c].songs;
+    for (int k = 0; out != NULL && k < queries.size (); k++) {
+      Outcome &o = outcomes[m][k];
+      fprintf (out, "%s\t%d\t%d\t%d\t%d\t%.3f\n", modes[m].name.c_str (), k, songs[queries[k].song].id,
+               o.position, (o.first < 0) ? -1 : songs[o.first].id, o.ms);
+    }
+  }
+  if (out != NULL) fclose (out);
+}
+
 
 /* Main program */
 
@@ -134,26 +542,30 @@ int main(int argc, char **argv)
   vector<int> seq;
   vector<int> reference_seq;
   vector<pair<int,double> > rank;
- 
-  
+
+
   // parse command line arguments
   parse_args (argc, argv);
-  
+
+  if (humming_input1 == NULL) {
+    evaluate ();
+    return 0;
+  }
+
   // read db.xml file
   XMLDocument doc;
   doc.LoadFile (db_input);
-  
+
   // read humming sequence
   read_stream (humming_input1, seq);
 
-  
+
   // read song sequence
   read_stream (humming_input2, reference_seq);
   // initialize process
   verbmsg (" analizando...\n");
-  matching (seq, reference_seq, 0, rank);
+  matching (seq, &reference_seq[0], reference_seq.size (), 0, rank);
   verbmsg ("..fin de la cancion\n\n");
-  
+
   return 0;
 }
-
@@ -0,0 +1,276 @@
+/*
+ Copyright (C) 2013-2014 Jose Alemany Bordera <joalbor1@inf.upv.es>
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+ * Append-only corpus of immutable segments.
+ *
+ * A segment is an xml database with its binary corpus, name.xml and name.bin
+ * next to the manifest. The manifest lists the segments and the deleted songs
+ * in the order they were added:
+ *
+ *   qbh-segments <number of the next segment>
+ *   segment <name>
+ *   delete <song id>
+ *
+ * A delete line is a tombstone for the song in the segments listed before
+ * it, and a song added again in a later segment replaces the older one.
+ * update_corpus adds segments and tombstones, and compacts the live songs of
+ * every segment into a single one. The manifest is always replaced by
+ * renaming a new file, so readers never see it half written.
+ */
+#include <set>
+#include <string>
+#include <sys/file.h>
+
+#define SEGMENTS_MAGIC "qbh-segments"
+
+// segment manifest
+char * db_segments = NULL;
+
+struct SegmentEntry {
+  string segment;              // name of an added segment, empty for a tombstone
+  int id;                      // song deleted by a tombstone
+};
+
+struct Segments {
+  string dir;                  // directory of the manifest and the segments
+  int next;                    // number of the next segment
+  vector<SegmentEntry> entries;
+  Segments () : next(0) {}
+};
+
+
+/* Functions */
+
+/**
+ * @brief Path of a file of a segment.
+ *
+ * @param m Segment manifest.
+ * @param name Name of the segment.
+ * @param ext Extension of the file, ".xml" or ".bin".
+ */
+string segment_path (Segments &m, const string &name, const char *ext)
+{
+  return m.dir + name + ext;
+}
+
+/**
+ * @brief Reads a segment manifest.
+ *
+ * @param path Path of the manifest.
+ * @param m Manifest object where the entries are stored.
+ * @param create Start an empty manifest if the file does not exist.
+ */
+void read_segments (const char *path, Segments &m, bool create)
+{
+  string p = path;
+  size_t slash = p.rfind ('/');
+  m.dir = (slash == string::npos) ? "" : p.substr (0, slash + 1);
+  m.next = 0;
+  m.entries.clear ();
+
+  FILE *in = fopen (path, "r");
+  if (in == NULL) {
+    if (create) return;
+    errmsg ("Error: could not open segment manifest '%s'\n", path);
+    exit (1);
+  }
+
+  char line[PATH_MAX + 16], word[16], name[PATH_MAX + 1];
+  if (fgets (line, sizeof (line), in) == NULL ||
+      sscanf (line, SEGMENTS_MAGIC " %d", &m.next) != 1) {
+    errmsg ("Error: '%s' is not a valid segment manifest\n", path);
+    exit (1);
+  }
+  while (fgets (line, sizeof (line), in) != NULL) {
+    SegmentEntry e;
+    e.id = -1;
+    if (sscanf (line, "%15s %s", word, name) != 2) continue;
+    if (strcmp (word, "segment") == 0) {
+      e.segment = name;
+    } else if (strcmp (word, "delete") != 0 || !parse_id (name, e.id)) {
+      errmsg ("Error: bad line in segment manifest '%s': %s", path, line);
+      exit (1);
+    }
+    m.entries.push_back (e);
+  }
+  fclose (in);
+}
+
+/**
+ * @brief Replaces a segment manifest.
+ *
+ * The manifest is written to a temporary file that is then renamed over it.
+ *
+ * @param path Path of the manifest.
+ * @param m Manifest to write.
+ */
+void write_segments (const char *path, Segments &m)
+{
+  string tmp = string (path) + ".tmp";
+  FILE *out = fopen (tmp.c_str (), "w");
+  if (out == NULL) {
+    errmsg ("Error: could not open segment manifest '%s'\n", tmp.c_str ());
+    exit (1);
+  }
+  fprintf (out, SEGMENTS_MAGIC " %d\n", m.next);
+  for (int k = 0; k < m.entries.size (); k++) {
+    if (m.entries[k].segment.empty ())
+      fprintf (out, "delete %d\n", m.entries[k].id);
+    else
+      fprintf (out, "segment %s\n", m.entries[k].segment.c_str ());
+  }
+  if (fflush (out) != 0 || fsync (fileno (out)) != 0 || fclose (out) != 0 ||
+      rename (tmp.c_str (), path) != 0) {
+    errmsg ("Error: could not write segment manifest '%s'\n", path);
+    exit (1);
+  }
+}
+
+/**
+ * @brief Serializes the writers of a segment manifest.
+ *
+ * @param path Path of the manifest.
+ * @return Descriptor of the lock file, closing it releases the lock.
+ */
+int lock_segments (const char *path)
+{
+  string lock = string (path) + ".lock";
+  int fd = open (lock.c_str (), O_RDWR | O_CREAT, 0644);
+  if (fd < 0 || flock (fd, LOCK_EX) < 0) {
+    errmsg ("Error: could not lock segment manifest '%s'\n", path);
+    exit (1);
+  }
+  return fd;
+}
+
+/**
+ * @brief Loads the live songs of every segment of a manifest.
+ *
+ * Each segment is mapped and loaded with the current matching method, and
+ * the sequences and strings of its live songs are copied to the corpus, so
+ * the segments can be unmapped afterwards.
+ *
+ * @param m Segment manifest.
+ * @param corpus Corpus object where the live songs are stored.
+ */
+void load_segments (Segments &m, Corpus &corpus)
+{
+  vector<Corpus> parts (m.entries.size ());
+  for (int k = 0; k < m.entries.size (); k++) {
+    if (m.entries[k].segment.empty ()) continue;
+    map_corpus (segment_path (m, m.entries[k].segment, ".bin").c_str (), parts[k]);
+    load_corpus (segment_path (m, m.entries[k].segment, ".xml").c_str (), parts[k]);
+  }
+
+  // walking backwards, a song is dead once deleted or added again later
+  vector<vector<bool> > live (m.entries.size ());
+  set<int> dead;
+  for (int k = m.entries.size () - 1; k >= 0; k--) {
+    if (m.entries[k].segment.empty ()) {
+      dead.insert (m.entries[k].id);
+      continue;
+    }
+    vector<Song> &songs = parts[k].songs;
+    live[k].resize (songs.size ());
+    for (int i = 0; i < songs.size (); i++) {
+      live[k][i] = (dead.count (songs[i].id) == 0);
+      dead.insert (songs[i].id);
+    }
+  }
+
+  corpus.songs.clear ();
+  corpus.pool.clear ();
+  corpus.chars.clear ();
+  corpus.interned.clear ();
+  for (int k = 0; k < m.entries.size (); k++) {
+    for (int i = 0; i < parts[k].songs.size (); i++) {
+      if (!live[k][i]) continue;
+      Song &s = parts[k].songs[i];
+      for (int j = 0; j < s.samples.size (); j++) {
+        const int *seq = parts[k].values + s.samples[j].seq;
+        s.samples[j].seq = corpus.pool.size ();
+        s.samples[j].path = intern (corpus, text (parts[k], s.samples[j].path));
+        corpus.pool.insert (corpus.pool.end (), seq, seq + s.samples[j].size);
+      }
+      s.author = intern (corpus, text (parts[k], s.author));
+      s.title = intern (corpus, text (parts[k], s.title));
+      s.genre = intern (corpus, text (parts[k], s.genre));
+      s.url = intern (corpus, text (parts[k], s.url));
+      // songs keep the order of the segments, and inside each one the order of its corpus
+      s.order += (long) k << 32;
+      corpus.songs.push_back (s);
+    }
+    if (parts[k].map != NULL) munmap (parts[k].map, parts[k].map_size);
+  }
+  corpus.values = corpus.pool.empty () ? NULL : &corpus.pool[0];
+  seal_strings (corpus);
+  verbmsg ("%lu live songs in %lu manifest entries\n", corpus.songs.size (), m.entries.size ());
+}
+
+/**
+ * @brief Writes the songs of a corpus as an xml database.
+ *
+ * The sample paths are kept relative to db_root.
+ *
+ * @param path Path of the xml database.
+ * @param corpus Corpus with the songs.
+ */
+void save_database (const char *path, Corpus &corpus)
+{
+  XMLDocument doc;
+  XMLElement *root = doc.NewElement("repertory");
+
+  for (int i = 0; i < corpus.songs.size (); i++) {
+    Song &song = corpus.songs[i];
+    XMLElement *so = doc.NewElement("song");
+    so->SetAttribute("id", song.id);
+    XMLElement *auth = doc.NewElement("author");
+    auth->SetText(text (corpus, song.author));
+    so->InsertEndChild(auth);
+    XMLElement *tit = doc.NewElement("title");
+    tit->SetText(text (corpus, song.title));
+    so->InsertEndChild(tit);
+    XMLElement *gen = doc.NewElement("genre");
+    gen->SetText(text (corpus, song.genre));
+    so->InsertEndChild(gen);
+    XMLElement *u = doc.NewElement("thumb_url");
+    u->SetText(text (corpus, song.url));
+    so->InsertEndChild(u);
+    XMLElement *samples = doc.NewElement("samples");
+    for (int j = 0; j < song.samples.size (); j++) {
+      XMLElement *sa = doc.NewElement("sample");
+      sa->SetAttribute("path", text (corpus, song.samples[j].path));
+      samples->InsertEndChild(sa);
+    }
+    so->InsertEndChild(samples);
+    root->InsertEndChild(so);
+  }
+  doc.InsertFirstChild(root);
+
+  FILE *out = fopen (path, "w");
+  if (out == NULL) {
+    errmsg ("Error: could not open database output file '%s'\n", path);
+    exit (1);
+  }
+  doc.SaveFile(out);
+  if (fclose (out) != 0) {
+    errmsg ("Error: could not write database '%s'\n", path);
+    exit (1);
+  }
+}
@@ -0,0 +1,154 @@
+/*
+ Copyright (C) 2013-2014 Jose Alemany Bordera <joalbor1@inf.upv.es>
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <climits>
+#include <csignal>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/*
+ * The matching engine talks a one line protocol over a local unix socket:
+ * the client sends the absolute path of a humming file ended by '\n' and the
+ * engine answers with the rank xml and closes the connection. A connection
+ * closed without any answer means that the query could not be processed.
+ */
+
+char * server_socket = NULL;
+
+
+/* Functions */
+
+/**
+ * @brief Fills a unix socket address.
+ *
+ * @param path Path of the socket in the file system.
+ * @param addr Address object to fill.
+ */
+int socket_address (const char *path, struct sockaddr_un &addr)
+{
+  memset (&addr, 0, sizeof (addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen (path) >= sizeof (addr.sun_path)) {
+    errmsg ("Error: socket path '%s' is too long\n", path);
+    return -1;
+  }
+  strcpy (addr.sun_path, path);
+  return 0;
+}
+
+/**
+ * @brief Sends a query to the matching engine.
+ *
+ * Sends the humming file to the engine listening on the socket and writes
+ * the rank xml it answers to the output file, or to stdout.
+ *
+ * @param path Path of the engine socket.
+ * @param hmg Path of the humming file.
+ * @param output Path of the output rank file, NULL for stdout.
+ */
+int query_server (const char *path, const char *hmg, const char *output)
+{
+  struct sockaddr_un addr;
+  char request[PATH_MAX + 1];
+  char buf[4096];
+  ssize_t n, total = 0;
+
+  if (realpath (hmg, request) == NULL) {
+    errmsg ("Error: could not open humming input file '%s'\n", hmg);
+    return 1;
+  }
+  strcat (request, "\n");
+
+  int fd = socket (AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 || socket_address (path, addr) < 0 ||
+      connect (fd, (struct sockaddr *) &addr, sizeof (addr)) < 0) {
+    errmsg ("Error: could not connect to matching engine '%s'\n", path);
+    return 1;
+  }
+  if (write (fd, request, strlen (request)) < 0) {
+    errmsg ("Error: could not send query to matching engine '%s'\n", path);
+    close (fd);
+    return 1;
+  }
+
+  FILE *out = stdout;
+  if (output != NULL && (out = fopen (output, "w")) == NULL) {
+    errmsg ("Error: could not open rank output file '%s'\n", output);
+    close (fd);
+    return 1;
+  }
+  while ((n = read (fd, buf, sizeof (buf))) > 0) {
+    fwrite (buf, 1, n, out);
+    total += n;
+  }
+  close (fd);
+  if (out != stdout) fclose (out);
+
+  if (total == 0) {
+    errmsg ("Error: matching engine could not process '%s'\n", hmg);
+    return 1;
+  }
+  return 0;
+}
+
+/**
+ * @brief Reads one request line from a client.
+ *
+ * @param fd Client connection.
+ * @param line Buffer where the line is stored without the '\n'.
+ * @param size Size of the buffer.
+ */
+int read_request (int fd, char *line, int size)
+{
+  int n = 0;
+  char c;
+
+  while (n < size - 1 && read (fd, &c, 1) == 1) {
+    if (c == '\n') {
+      line[n] = '\0';
+      return n;
+    }
+    line[n++] = c;
+  }
+  line[n] = '\0';
+  return (n > 0) ? n : -1;
+}
+
+/**
+ * @brief Opens the listening socket of the matching engine.
+ *
+ * @param path Path of the socket in the file system. A stale socket is removed.
+ */
+int listen_server (const char *path)
+{
+  struct sockaddr_un addr;
+
+  int fd = socket (AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 || socket_address (path, addr) < 0) {
+    errmsg ("Error: could not create socket '%s'\n", path);
+    exit (1);
+  }
+  unlink (path);
+  if (bind (fd, (struct sockaddr *) &addr, sizeof (addr)) < 0 || listen (fd, 16) < 0) {
+    errmsg ("Error: could not listen on socket '%s'\n", path);
+    exit (1);
+  }
+  // a client that goes away must not kill the engine
+  signal (SIGPIPE, SIG_IGN);
+  return fd;
+}
@@ -0,0 +1,108 @@
+/*
+ Copyright (C) 2013-2014 Jose Alemany Bordera <joalbor1@inf.upv.es>
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+ * Streaming DTW matching.
+ *
+ * The DTW grid of a query is computed one humming note per row, so the last
+ * row of every sample of the corpus is kept and each new note only adds one
+ * row to them. A provisional rank can be read at any point from those rows,
+ * with the admissible lengths of the notes fed so far. Once every note has
+ * been fed, the rank is the one dtw_matching gives for the whole query.
+ *
+ * Only the plain dtw method streams: the band of cdtw and the reduction of
+ * the cascade depend on the length of the whole query.
+ */
+
+struct Stream {
+  vector<int> seq;             // notes fed so far
+  vector<Row> rows;            // last row of every sample, in corpus order
+  Row next;                    // row being computed
+  Scratch sc;
+};
+
+
+/* Functions */
+
+/**
+ * @brief Starts a new query.
+ *
+ * @param st Stream state.
+ * @param corpus Corpus loaded with the dtw method.
+ */
+void stream_start (Stream &st, Corpus &corpus)
+{
+  int n = 0;
+  for (int i = 0; i < corpus.songs.size (); i++)
+    n += corpus.songs[i].samples.size ();
+  st.seq.clear ();
+  st.rows.resize (n);
+}
+
+/**
+ * @brief Adds a humming note to the query.
+ *
+ * Computes one more row of the DTW grid of every sample.
+ *
+ * @param st Stream state.
+ * @param corpus Corpus the stream was started with.
+ * @param note MIDI note.
+ */
+void stream_note (Stream &st, Corpus &corpus, int note)
+{
+  bool first = st.seq.empty ();
+  st.seq.push_back (note);
+
+  for (int i = 0, k = 0; i < corpus.songs.size (); i++) {
+    vector<Sample> &samples = corpus.songs[i].samples;
+    for (int j = 0; j < samples.size (); j++, k++) {
+      const int *r_seq = corpus.values + samples[j].seq;
+      int r_size = samples[j].size;
+      if (r_size < 1) continue;
+      if (first) {
+        first_row<DtwStep> (note, r_seq, r_size, st.rows[k]);
+      } else {
+        st.next.resize (r_size);
+        next_row<DtwStep> (note, r_seq, r_size, st.rows[k], st.next);
+        swap (st.rows[k], st.next);
+      }
+    }
+  }
+}
+
+/**
+ * @brief Rank list of the notes fed so far.
+ *
+ * @param st Stream state.
+ * @param corpus Corpus the stream was started with.
+ * @param rank Rank list where the <song, similarity> pairs are stored.
+ */
+void stream_rank (Stream &st, Corpus &corpus, vector<pair<int,double> > &rank)
+{
+  rank.clear ();
+  if (st.seq.empty ()) return;
+
+  for (int i = 0, k = 0; i < corpus.songs.size (); i++) {
+    Song &song = corpus.songs[i];
+    for (int j = 0; j < song.samples.size (); j++, k++) {
+      if (song.samples[j].size < 1) continue;
+      keep_last_row (st.sc, st.rows[k], song.samples[j].size);
+      select_hits (st.sc, st.seq.size (), DtwHits::max_norm (), DtwHits::penalty (), i, rank);
+    }
+  }
+}
@@ -0,0 +1,274 @@
+/*
+ Copyright (C) 2013-2014 Jose Alemany Bordera <joalbor1@inf.upv.es>
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "utils.h"
+#include "corpus.h"
+#include "segments.h"
+#include "stream.h"
+
+
+char * stream_input = NULL;
+// notes between two provisional ranks
+int rank_every = 1;
+// time without new notes after which a humming file is over, in ms
+int follow_ms = 1000;
+
+
+/* Functions */
+
+/**
+ * @brief Shows how the program is used.
+ *
+ * Shows how the program is used and the allowed options.
+ * After running, the program finishes execution.
+ *
+ * @param stream Pointer to a FILE object that identifies an output stream.
+ * @param exit_code Status code.
+ *                  If this is 0 or EXIT_SUCCESS, it indicates success.
+ *                  If it is EXIT_FAILURE, it indicates failure.
+ */
+void usage (FILE * stream, int exit_code)
+{
+  fprintf (stream, "usage: %s humming_input [ options ] \n", prog_name);
+  fprintf (stream,
+           "       -i      --input-database   xml file database\n"
+           "       -b      --binary-database  binary corpus file built by build_corpus\n"
+           "       -u      --segments         segment manifest written by update_corpus\n"
+           "       -o      --output-rank      output xml file with the final rank list\n"
+           "       -r      --rank-size        number of songs in the rank\n"
+           "       -e      --every            notes between two provisional ranks\n"
+           "       -t      --timeout          ms without new notes that end a humming file, 0 reads it to its end\n"
+           "       -v      --verbose          be verbose\n"
+           "       -h      --help             display this message\n"
+           "\n"
+           "The humming notes are read as they are written, '-' reads them from the\n"
+           "standard input. A humming file is followed while it grows, until no note\n"
+           "comes for the timeout or a line that is not a note, such as 'end', is\n"
+           "written. A pipe ends when its writer closes it. The provisional ranks are\n"
+           "shown on the standard error.\n"
+           );
+  exit (exit_code);
+}
+
+/**
+ * @brief Parses command line arguments.
+ *
+ * Parses command line arguments and detects misuse.
+ *
+ * @param argc Number of arguments received by command line.
+ * @param argv Arguments received by command line.
+ */
+int parse_args (int argc, char **argv)
+{
+  const char *options = "hvi:b:u:o:r:e:t:";
+  int next_option;
+  struct option long_options[] = {
+    {"help",                  0, NULL, 'h'},
+    {"verbose",               0, NULL, 'v'},
+    {"input-database",        1, NULL, 'i'},
+    {"binary-database",       1, NULL, 'b'},
+    {"segments",              1, NULL, 'u'},
+    {"output-rank",           1, NULL, 'o'},
+    {"rank-size",             1, NULL, 'r'},
+    {"every",                 1, NULL, 'e'},
+    {"timeout",               1, NULL, 't'},
+    {NULL,                    0, NULL, 0}
+  };
+
+  prog_name = argv[0];
+
+  // if required parameters are not received
+  if (argc < 2) {
+    usage (stderr, 1);
+    return -1;
+  }
+
+  stream_input = argv[1];
+
+  do {
+    next_option = getopt_long (argc, argv, options, long_options, NULL);
+    switch (next_option) {
+      case 'h':                // help
+        usage (stdout, 0);
+        return -1;
+      case 'v':                // verbose
+        verbose = 1;
+        break;
+      case 'i':
+        db_input = optarg;
+        break;
+      case 'b':
+        db_binary = optarg;
+        break;
+      case 'u':
+        db_segments = optarg;
+        break;
+      case 'o':
+        rank_output = optarg;
+        break;
+      case 'r':
+        rank_size = atoi (optarg);
+        break;
+      case 'e':
+        rank_every = atoi (optarg);
+        break;
+      case 't':
+        follow_ms = atoi (optarg);
+        break;
+      case '?':                // unknown options
+        usage (stderr, 1);
+        break;
+      case -1:                 // done with options
+        break;
+      default:                 // something else unexpected
+        fprintf (stderr, "Error parsing option '%c'\n", next_option);
+        abort ();
+    }
+  } while (next_option != -1);
+
+  if (rank_size < 1 || rank_every < 1) {
+    errmsg ("Error: rank size and notes between ranks must be positive.\n");
+    exit (1);
+  }
+  if (follow_ms < 0) {
+    errmsg ("Error: timeout must not be negative.\n");
+    exit (1);
+  }
+
+  return 0;
+}
+
+/**
+ * @brief Reads the next line of the humming.
+ *
+ * The melody extractor may still be writing a humming file, so at its end the
+ * rest of the line is waited for, until follow_ms pass without new data.
+ * Half written lines are never returned before their end.
+ *
+ * @param in Humming stream.
+ * @param follow Whether to wait at the end of the stream.
+ * @param line Where the line is stored.
+ * @return false at the end of the humming.
+ */
+bool read_line (FILE *in, bool follow, string &line)
+{
+  char buf[256];
+  double last = now ();
+
+  line.clear ();
+  while (true) {
+    if (fgets (buf, sizeof (buf), in) != NULL) {
+      line += buf;
+      last = now ();
+      if (line[line.size () - 1] == '\n') return true;
+      continue;
+    }
+    if (!follow || ferror (in) || (now () - last) * 1e3 >= follow_ms) return !line.empty ();
+    clearerr (in);
+    usleep (10000);
+  }
+}
+
+/**
+ * @brief Shows the best rank_size different songs of a provisional rank.
+ *
+ * @param rank Rank list with <song, similarity> pairs, sorted on return.
+ * @param corpus Corpus with the metadata of the songs.
+ * @param notes Notes fed so far.
+ * @param ms Time spent on the last note, in milliseconds.
+ */
+void print_provisional (vector<pair<int,double> > &rank, Corpus &corpus, int notes, double ms)
+{
+  vector<pair<int,double> > best;
+
+  sort (rank.begin (), rank.end (), cmp);
+  fprintf (stderr, "%d notes (%.3f ms):", notes, ms);
+  for (int k = 0; k < rank.size () && best.size () < rank_size; k++) {
+    if (in_rank (best, rank[k].first)) continue;
+    best.push_back (rank[k]);
+    Song &song = corpus.songs[rank[k].first];
+    fprintf (stderr, " %s (%.3f)%s", text (corpus, song.title), rank[k].second,
+             (best.size () < rank_size) ? "," : "");
+  }
+  fprintf (stderr, "\n");
+}
+
+
+/* Main program */
+
+int main(int argc, char **argv)
+{
+  // variables
+  vector<pair<int,double> > rank;
+  Corpus corpus;
+  Stream st;
+  double onset, duration, note;
+
+
+  // parse command line arguments
+  parse_args (argc, argv);
+  matching_method = "dtw";
+
+  // read db.xml file and every song sequence, or the live segments
+  if (db_segments != NULL) {
+    Segments m;
+    read_segments (db_segments, m, false);
+    load_segments (m, corpus);
+  } else {
+    if (db_binary != NULL) map_corpus (db_binary, corpus);
+    load_corpus (db_input, corpus);
+  }
+
+  FILE *in = stdin;
+  if (strcmp (stream_input, "-") != 0 && (in = fopen (stream_input, "r")) == NULL) {
+    errmsg ("Error: could not open humming input file '%s'\n", stream_input);
+    exit (1);
+  }
+
+  // only a regular file can grow after its end is read
+  struct stat in_stat;
+  bool follow = follow_ms > 0 && fstat (fileno (in), &in_stat) == 0 && S_ISREG (in_stat.st_mode);
+
+  // one DTW row of every sample per note, as convert_to_MIDI reads them
+  stream_start (st, corpus);
+  string line;
+  while (read_line (in, follow, line)) {
+    if (line.find_first_not_of (" \t\r\n") == string::npos) continue;
+    if (sscanf (line.c_str (), "%lf %lf %lf", &onset, &duration, &note) != 3) break;
+    if (!note) continue;
+    double t = now ();
+    stream_note (st, corpus, note);
+    if (st.seq.size () % rank_every == 0) {
+      stream_rank (st, corpus, rank);
+      print_provisional (rank, corpus, st.seq.size (), (now () - t) * 1e3);
+    }
+  }
+  if (in != stdin) fclose (in);
+
+  // save the result
+  stream_rank (st, corpus, rank);
+  FILE *out = stdout;
+  if (rank_output != NULL && (out = fopen (rank_output, "w")) == NULL) {
+    errmsg ("Error: could not open rank output file '%s'\n", rank_output);
+    exit (1);
+  }
+  save_rank (rank, corpus, out);
+  if (out != stdout) fclose (out);
+
+  return 0;
+}
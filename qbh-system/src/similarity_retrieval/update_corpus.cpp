@@ -0,0 +1,278 @@
+/*
+ Copyright (C) 2013-2014 Jose Alemany Bordera <joalbor1@inf.upv.es>
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "utils.h"
+#include "corpus.h"
+#include "segments.h"
+
+
+char * command = NULL;
+
+
+/* Functions */
+
+/**
+ * @brief Shows how the program is used.
+ *
+ * Shows how the program is used and the allowed options.
+ * After running, the program finishes execution.
+ *
+ * @param stream Pointer to a FILE object that identifies an output stream.
+ * @param exit_code Status code.
+ *                  If this is 0 or EXIT_SUCCESS, it indicates success.
+ *                  If it is EXIT_FAILURE, it indicates failure.
+ */
+void usage (FILE * stream, int exit_code)
+{
+  fprintf (stream, "usage: %s manifest add input_database [ options ] \n", prog_name);
+  fprintf (stream, "       %s manifest delete song_id ... \n", prog_name);
+  fprintf (stream, "       %s manifest compact [ options ] \n", prog_name);
+  fprintf (stream,
+           "       -r      --db-root          directory the sample paths are relative to\n"
+           "       -v      --verbose          be verbose\n"
+           "       -h      --help             display this message\n"
+           "\n"
+           "add writes the songs of the database to a new segment, replacing the ones\n"
+           "with the same id, delete adds tombstones and compact merges the live songs\n"
+           "of every segment into one.\n"
+           );
+  exit (exit_code);
+}
+
+/**
+ * @brief Parses command line arguments.
+ *
+ * Parses command line arguments and detects misuse.
+ *
+ * @param argc Number of arguments received by command line.
+ * @param argv Arguments received by command line.
+ */
+int parse_args (int argc, char **argv)
+{
+  const char *options = "hvr:";
+  int next_option;
+  struct option long_options[] = {
+    {"help",                  0, NULL, 'h'},
+    {"verbose",               0, NULL, 'v'},
+    {"db-root",               1, NULL, 'r'},
+    {NULL,                    0, NULL, 0}
+  };
+
+  prog_name = argv[0];
+
+  // if required parameters are not received
+  if (argc < 3) {
+    usage (stderr, 1);
+    return -1;
+  }
+
+  db_segments = argv[1];
+  command = argv[2];
+
+  do {
+    next_option = getopt_long (argc, argv, options, long_options, NULL);
+    switch (next_option) {
+      case 'h':                // help
+        usage (stdout, 0);
+        return -1;
+      case 'v':                // verbose
+        verbose = 1;
+        break;
+      case 'r':
+        db_root = optarg;
+        break;
+      case '?':                // unknown options
+        usage (stderr, 1);
+        break;
+      case -1:                 // done with options
+        break;
+      default:                 // something else unexpected
+        fprintf (stderr, "Error parsing option '%c'\n", next_option);
+        abort ();
+    }
+  } while (next_option != -1);
+
+  // the manifest and the command are not arguments of the command
+  optind += 2;
+  if (strcmp (command, "add") == 0 && argc - optind != 1) {
+    errmsg ("Error: add needs one input database.\n");
+    exit (1);
+  }
+  if (strcmp (command, "delete") == 0 && argc - optind < 1) {
+    errmsg ("Error: delete needs the ids of the songs.\n");
+    exit (1);
+  }
+  if (strcmp (command, "compact") == 0 && argc - optind != 0) {
+    errmsg ("Error: compact has no arguments.\n");
+    exit (1);
+  }
+  if (strcmp (command, "add") != 0 && strcmp (command, "delete") != 0 &&
+      strcmp (command, "compact") != 0) {
+    errmsg ("Error: unknown command %s.\n", command);
+    exit (1);
+  }
+
+  return 0;
+}
+
+/**
+ * @brief Writes a segment with the MIDI and UDS sequences of some songs.
+ *
+ * @param m Segment manifest.
+ * @param name Name of the segment.
+ * @param midi Corpus with the MIDI sequences.
+ * @param uds Corpus with the UDS sequences of the same songs.
+ */
+void save_segment (Segments &m, const string &name, Corpus &midi, Corpus &uds)
+{
+  save_corpus (segment_path (m, name, ".bin").c_str (), midi, uds);
+  save_database (segment_path (m, name, ".xml").c_str (), midi);
+  verbmsg ("segment '%s': %lu songs, %lu + %lu values\n", name.c_str (), midi.songs.size (),
+           midi.pool.size (), uds.pool.size ());
+}
+
+string segment_name (int number)
+{
+  char name[32];
+  sprintf (name, "seg-%06d", number);
+  return name;
+}
+
+/**
+ * @brief Adds the songs of an xml database as a new segment.
+ *
+ * Only the samples of these songs are read, so the cost does not depend on
+ * the size of the corpus.
+ */
+void add_segment (const char *db)
+{
+  Segments m;
+  Corpus midi, uds;
+
+  int lock = lock_segments (db_segments);
+  read_segments (db_segments, m, true);
+
+  matching_method = "dtw";
+  load_corpus (db, midi);
+  matching_method = "uds";
+  load_corpus (db, uds);
+
+  SegmentEntry e;
+  e.segment = segment_name (m.next++);
+  e.id = -1;
+  save_segment (m, e.segment, midi, uds);
+  m.entries.push_back (e);
+  write_segments (db_segments, m);
+  close (lock);
+}
+
+void delete_songs (char **ids, int n)
+{
+  Segments m;
+
+  int lock = lock_segments (db_segments);
+  read_segments (db_segments, m, false);
+  for (int k = 0; k < n; k++) {
+    SegmentEntry e;
+    if (!parse_id (ids[k], e.id)) {
+      errmsg ("Error: bad song id '%s'\n", ids[k]);
+      exit (1);
+    }
+    m.entries.push_back (e);
+  }
+  write_segments (db_segments, m);
+  close (lock);
+}
+
+/**
+ * @brief Merges the live songs of every segment into a new one.
+ *
+ * The manifest is only locked to read it and to replace it, so songs can be
+ * added or deleted while the segment is written. Those entries are kept
+ * after the new segment, and the old segments are removed afterwards.
+ */
+void compact_segments ()
+{
+  Segments m, now;
+  Corpus midi, uds;
+
+  int lock = lock_segments (db_segments);
+  read_segments (db_segments, m, false);
+  int n_segments = 0;
+  for (int k = 0; k < m.entries.size (); k++)
+    if (!m.entries[k].segment.empty ()) n_segments++;
+  if (n_segments == m.entries.size () && n_segments <= 1) {
+    verbmsg ("nothing to compact\n");
+    close (lock);
+    return;
+  }
+  // reserve the number of the new segment
+  string name = segment_name (m.next++);
+  write_segments (db_segments, m);
+  close (lock);
+
+  matching_method = "dtw";
+  load_segments (m, midi);
+  matching_method = "uds";
+  load_segments (m, uds);
+  save_segment (m, name, midi, uds);
+
+  lock = lock_segments (db_segments);
+  read_segments (db_segments, now, false);
+  bool same = (now.entries.size () >= m.entries.size ());
+  for (int k = 0; same && k < m.entries.size (); k++)
+    same = (now.entries[k].segment == m.entries[k].segment && now.entries[k].id == m.entries[k].id);
+  if (!same) {
+    errmsg ("Error: segment manifest '%s' was compacted by someone else\n", db_segments);
+    unlink (segment_path (m, name, ".bin").c_str ());
+    unlink (segment_path (m, name, ".xml").c_str ());
+    exit (1);
+  }
+  SegmentEntry e;
+  e.segment = name;
+  e.id = -1;
+  now.entries.erase (now.entries.begin (), now.entries.begin () + m.entries.size ());
+  now.entries.insert (now.entries.begin (), e);
+  write_segments (db_segments, now);
+  close (lock);
+
+  // programs that already mapped the old segments keep their copy
+  for (int k = 0; k < m.entries.size (); k++) {
+    if (m.entries[k].segment.empty ()) continue;
+    unlink (segment_path (m, m.entries[k].segment, ".bin").c_str ());
+    unlink (segment_path (m, m.entries[k].segment, ".xml").c_str ());
+  }
+}
+
+
+/* Main program */
+
+int main(int argc, char **argv)
+{
+  // parse command line arguments
+  parse_args (argc, argv);
+
+  if (strcmp (command, "add") == 0)
+    add_segment (argv[optind]);
+  else if (strcmp (command, "delete") == 0)
+    delete_songs (argv + optind, argc - optind);
+  else
+    compact_segments ();
+
+  return 0;
+}
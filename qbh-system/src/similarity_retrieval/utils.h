@@ -21,11 +21,13 @@
 #include <cstdarg>
 #include <cmath>
 #include <cstring>
+#include <climits>
 #include <vector>
 #include <algorithm>
 #include <getopt.h>
 #include <unistd.h>
 #include <dirent.h>
+#include <sys/time.h>
 #include "tinyxml2.h"
 
 #ifdef HAVE_DEBUG
@@ -47,15 +49,30 @@ using namespace tinyxml2;
 
 int verbose = 0;
 // input / output
-char * db_input = "../../db/db.xml";
+const char * db_input = "../../db/db.xml";
 char * rank_output = NULL;
 char * humming_input = NULL;
 // matching method stuff
-char * matching_method = "default";
+const char * matching_method = "default";
 int sim_threshold = 0;
 // general stuff
 vector<char> reference_secuence;
 vector<char> secuence;
+// rank stuff
+int rank_size = 5;
+// non-overlapping matches of a song taken per reference
+int max_hits = 1;
+// pruning stuff
+int prune = 0;
+// vectorized kernels
+int simd = 0;
+int validate = 0;
+long validated = 0, validate_errors = 0;
+// constrained dtw stuff
+int band = 3;
+// cascade stuff
+int paa = 4;
+long cascaded = 0, cascade_differ = 0, cascade_missed = 0, cascade_error = 0;
 // internal stuff
 const char *prog_name;
 // stuff
@@ -70,28 +87,85 @@ struct Cost {
   }
 };
 
+struct Pruning {
+  double threshold;            // similarity of the rank_size-th best song so far
+  vector<pair<int,double> > best;   // best songs so far, ascending
+  long samples, samples_pruned, samples_abandoned;
+  long cells, cells_pruned;
+  Pruning () : threshold(HUGE_VAL), samples(0), samples_pruned(0), samples_abandoned(0), cells(0), cells_pruned(0) {}
+};
+
+// DP row, or anti-diagonal, as separate arrays
+struct Row {
+  vector<int> ini, score, height;
+  void resize (int n) { ini.resize (n); score.resize (n); height.resize (n); }
+};
+
+// buffers reused by the kernels from one reference to the next
+struct Scratch {
+  Row rows[3];
+  vector<int> r_rev;
+  vector<Cost> last;           // end cells of the last row
+  vector<Cost> hits;
+  vector<int> coarse, r_coarse;     // reduced sequences of the cascade
+  vector<Cost> found;          // end cells of the refined windows
+};
+
+typedef void (*MatchFunction) (const vector<int> &seq, const int *r_seq, int r_size, int id_song,
+                               vector<pair<int,double> > &rank, Pruning *pr, Scratch &sc);
+
+// a matching method, as selected by its name
+struct MatchingMethod {
+  const char *name;
+  void (*convert) (FILE *stream, vector<int> &seq);
+  MatchFunction match;
+};
+
 int distance_ij(int a, int b)
 {
   int d = abs (a - b);
   return (d > 12) ? 12 : d;
 }
 
-int min(Cost &c1, Cost &c2, Cost &c3, int d)
+int min_dist(int a1, int s1, int a2, int s2, int a3, int s3)
 {
-  int a1 = abs (c1.height - d), a2 = abs (c2.height - d), a3 = abs (c3.height - d);
   if (a1 < a2 && a1 < a3) return 1;
   else if (a2 < a1 && a2 < a3) return 2;
   else if (a3 < a1 && a3 < a2) return 3;
   else {
-    if (a1 == a2 && a1 == a3)  return pos_min(c1.score, c2.score, c3.score);
-    else if (a1 == a2) return pos_min(c1.score, c2.score, 1000);
-    else if (a1 == a3) return pos_min(c1.score, 1000, c3.score);
-    else /*if (a2 == a3)*/ return pos_min(1000, c2.score, c3.score);
+    if (a1 == a2 && a1 == a3)  return pos_min(s1, s2, s3);
+    else if (a1 == a2) return pos_min(s1, s2, 1000);
+    else if (a1 == a3) return pos_min(s1, 1000, s3);
+    else /*if (a2 == a3)*/ return pos_min(1000, s2, s3);
   }
 }
 
+int min_step(int h1, int s1, int h2, int s2, int h3, int s3, int d)
+{
+  return min_dist (abs (h1 - d), s1, abs (h2 - d), s2, abs (h3 - d), s3);
+}
+
+int min(Cost &c1, Cost &c2, Cost &c3, int d)
+{
+  return min_step (c1.height, c1.score, c2.height, c2.score, c3.height, c3.score, d);
+}
+
+#include "dtw_simd.h"
+#include "metrics.h"
+
 /* Functions */
 
+const MatchingMethod *find_method (const char *name);
+
+/**
+ * @brief Value under which a fraction p of some sorted values lie.
+ */
+double percentile (vector<double> &sorted, double p)
+{
+  int k = (int) ceil (p * sorted.size ()) - 1;
+  return sorted[max (0, k)];
+}
+
 void convert_to_UDS (FILE *stream, vector<int> &seq)
 {
   double onset, duration, note;
@@ -131,131 +205,752 @@ void read_stream (char *hmg, vector<int> &seq)
   
   seq.clear ();
   
-  if (strcmp (matching_method, "uds") == 0)
-    convert_to_UDS (this_sec, seq);
-  else if (strcmp (matching_method, "dtw") == 0)
-    convert_to_MIDI (this_sec, seq);
+  const MatchingMethod *method = find_method (matching_method);
+  if (method != NULL) method->convert (this_sec, seq);
     
+  metric_add (run_metrics.bytes, ftell (this_sec));
   fclose (this_sec);
 }
 
-void dtw_matching (vector<int> seq, vector<int> r_seq, int id_song, vector<pair<int,double> > &rank)
+/* Pruning functions */
+
+/*
+ * A match is only accepted when its length (fin - ini) is below (3-p)*|seq|,
+ * so any partial score S of a path bounds its similarity: S / ((3-p)*|seq|)
+ * is strictly smaller than the final one as soon as S > 0. Songs and rows
+ * whose bound reaches the limit can never enter the rank.
+ *
+ * Dividing by the longest admissible length keeps the bounds exact but loose:
+ * a dtw path may still widen to (3-p)*|seq| at any row, so on real songs
+ * neither the bound nor the rows of dtw ever get over the rank threshold.
+ * The band of cdtw drops the cheap cells of paths out of slope, so its rows
+ * reach it and abandon the songs that cannot enter the rank.
+ */
+
+/**
+ * @brief Lower bound of the DTW score of a query against a reference.
+ *
+ * Every path scores |(seq[i] - seq[0]) - (r_seq[j] - r_seq[ini])| in each row,
+ * and the reference interval is always a difference of two of its pitches.
+ * The distance of each query interval to the set of those differences is
+ * summed over the rows.
+ *
+ * @param seq Humming MIDI sequence.
+ * @param r_seq Reference MIDI sequence.
+ * @param r_size Length of the reference sequence.
+ */
+int pitch_lower_bound (const vector<int> &seq, const int *r_seq, int r_size)
 {
-  verbmsg ("%lu %lu\n", seq.size(), r_seq.size());
-  vector<Cost> prev, curr;
-  
-  // DTW Matching Algorithm
-  for (int j = 0; j < r_seq.size (); j++)
-    prev.push_back (Cost (j, j, 0, (seq[0] - r_seq[j])));
-  for (int i = 1; i < seq.size (); i++) {
-    int dist_ij = (seq[i] - r_seq[0]);
-    curr.push_back (Cost (0, 0, prev[0].score + abs (prev[0].height - dist_ij), prev[0].height));
-    for (int j = 1; j < r_seq.size (); j++) {
-      int dist_ij = (seq[i] - r_seq[j]);
-      int m = min (curr[j-1], prev[j], prev[j-1], dist_ij);
-      if (m == 1) {
-        curr.push_back (Cost (curr[j-1].ini, j, curr[j-1].score + abs (curr[j-1].height - dist_ij), curr[j-1].height));
-      } else if (m == 2) {
-        curr.push_back (Cost (prev[j].ini, j, prev[j].score + abs (prev[j].height - dist_ij), prev[j].height));
-      } else {
-        curr.push_back (Cost (prev[j-1].ini, j, prev[j-1].score + abs (prev[j-1].height - dist_ij), prev[j-1].height));
-      }
+  bool pitch[128] = {0}, diff[255] = {0};
+  int pitches[128], n = 0;
+  int lb = 0;
+
+  // without notes there is no interval to search for
+  if (r_size <= 0 || seq.empty ()) return 0;
+  for (int j = 0; j < r_size; j++) {
+    if (r_seq[j] < 0 || r_seq[j] > 127) return 0;
+    if (!pitch[r_seq[j]]) {
+      pitch[r_seq[j]] = true;
+      pitches[n++] = r_seq[j];
     }
-    prev.swap (curr);
-    curr.clear ();
   }
+  for (int a = 0; a < n; a++)
+    for (int b = 0; b < n; b++)
+      diff[pitches[a] - pitches[b] + 127] = true;
+
+  for (int i = 1; i < seq.size (); i++) {
+    int d = seq[i] - seq[0] + 127, k = 0;
+    if (d < 0 || d > 254) return 0;
+    while ((d-k < 0 || !diff[d-k]) && (d+k > 254 || !diff[d+k])) k++;
+    lb += k;
+  }
+  return lb;
+}
+
+bool pruned (int score, int seq_size, double limit)
+{
+  double p = 0.6;
+  return score > 0 && ((double)score) / ((3-p)*seq_size) >= limit;
+}
+
+/**
+ * @brief Early abandoning of a DP.
+ *
+ * Checks whether every cell of the last computed row is over the limit.
+ *
+ * @param score Scores of the last computed row.
+ * @param size Length of the row.
+ * @param i Index of the row.
+ * @param seq_size Length of the humming sequence.
+ * @param limit Similarity a match must be under.
+ * @param pr Pruning counters.
+ */
+bool abandoned (const int *score, int size, int i, int seq_size, double limit, Pruning *pr)
+{
+  int best = score[0];
+  for (int j = 1; j < size; j++)
+    if (score[j] < best) best = score[j];
+
+  pr->cells += size;
+  if (!pruned (best, seq_size, limit)) return false;
+  pr->samples_abandoned++;
+  pr->cells_pruned += (long) (seq_size - 1 - i) * size;
+  return true;
+}
+
+/**
+ * @brief Updates the pruning threshold with a new similarity.
+ *
+ * @param pr Pruning state.
+ * @param id_song Identifier of the song.
+ * @param sim Similarity of the song.
+ */
+void update_pruning (Pruning &pr, int id_song, double sim)
+{
+  vector<pair<int,double> > &best = pr.best;
+  int k = 0;
+  while (k < best.size () && best[k].first != id_song) k++;
+  if (k < best.size ()) {
+    if (sim >= best[k].second) return;
+    best.erase (best.begin () + k);
+  }
+  k = 0;
+  while (k < best.size () && best[k].second <= sim) k++;
+  best.insert (best.begin () + k, make_pair (id_song, sim));
+  if (best.size () > rank_size) best.pop_back ();
+  if (best.size () == rank_size) pr.threshold = best.back ().second;
+}
+
+/**
+ * @brief Clears a pruning state keeping its memory.
+ */
+void reset_pruning (Pruning &pr)
+{
+  pr.threshold = HUGE_VAL;
+  pr.best.clear ();
+  pr.samples = pr.samples_pruned = pr.samples_abandoned = 0;
+  pr.cells = pr.cells_pruned = 0;
+}
+
+/* Matching functions */
+
+bool worse_cost (const Cost &c1, const Cost &c2)
+{
+  return c2 < c1;
+}
+
+bool ends_before (const Cost &c1, const Cost &c2)
+{
+  return c1.fin < c2.ini;
+}
+
+/**
+ * @brief Takes the best non-overlapping end cells.
+ *
+ * The cells are taken ascending by normalized score out of a heap, so only
+ * the ones looked at are ordered. The hits taken are disjoint and kept
+ * sorted by their start, so a binary search finds the last one starting at
+ * or before the end of a candidate, the only one that can overlap it. Taking
+ * n hits out of t cells costs O(t log t).
+ *
+ * @param cells End cells, reordered on return.
+ * @param n Most hits to take.
+ * @param hits Vector where the hits are stored, sorted by start.
+ */
+void take_hits (vector<Cost> &cells, int n, vector<Cost> &hits)
+{
+  make_heap (cells.begin (), cells.end (), worse_cost);
+  hits.clear ();
+  for (int end = cells.size (); end > 0 && hits.size () < n; end--) {
+    pop_heap (cells.begin (), cells.begin () + end, worse_cost);
+    Cost &c = cells[end - 1];
+    vector<Cost>::iterator next = upper_bound (hits.begin (), hits.end (), c, ends_before);
+    if (next != hits.begin () && (next - 1)->fin >= c.ini) continue;
+    hits.insert (next, c);
+  }
+}
+
+/**
+ * @brief Selects the hits of a song from the last row of the DP.
+ *
+ * Drops the end cells whose length is not admissible and takes the best
+ * max_hits non-overlapping ones. The song similarity, the mean of their
+ * normalized scores less a bonus per extra hit, is added to the rank list.
+ *
+ * @param sc Scratch buffers, sc.last holds the last row.
+ * @param seq_size Length of the humming sequence.
+ * @param max_norm Normalized scores must be under this value.
+ * @param penalty Similarity bonus per extra hit.
+ * @param id_song Identifier of the song.
+ * @param rank Rank list where the <song, similarity> pairs are stored.
+ */
+void select_hits (Scratch &sc, int seq_size, double max_norm, double penalty, int id_song, vector<pair<int,double> > &rank)
+{
+  vector<Cost> &prev = sc.last, &curr = sc.hits;
+  double p = 0.6;
   
-  // Transform the result <(ini, score), fin> in <ini, fin> ordered ascending by score
-  sort (prev.begin (), prev.end ());
+  // keep the admissible end cells
+  int k = 0;
+  for (int i = 0; i < prev.size (); i++) {
+    double len = prev[i].fin - prev[i].ini;
+    if (len > p*seq_size && len < (3-p)*seq_size && prev[i].score / len < max_norm)
+      prev[k++] = prev[i];
+  }
+  prev.erase (prev.begin () + k, prev.end ());
+  
+  take_hits (prev, max_hits, curr);
   
   double s = 0.0;
-  double p = 0.6;
-  for (int i = 0; i < prev.size (); i++) {
-    //verbmsg ("ini: %d\tfin: %d\tscore: %d\tnorm_score: %lf\n", prev[i].ini, prev[i].fin, prev[i].score, ((double)prev[i].score) / ((double)(prev[i].fin-prev[i].ini)));
-    bool ok = true;
-    for (int j = 0; j < curr.size (); j++) {
-      if ((prev[i].ini >= curr[j].ini && prev[i].ini <= curr[j].fin) ||
-          (prev[i].fin >= curr[j].ini && prev[i].fin <= curr[j].fin)) {
-        ok = false;
-      }
-    }
-    double norm_score = ((double)prev[i].score) / ((double)(prev[i].fin-prev[i].ini));
-    if (ok && (norm_score < 3 && ((double)(prev[i].fin-prev[i].ini)) > p*seq.size() && ((double)(prev[i].fin-prev[i].ini)) < (3-p)*seq.size()) && curr.size() < 1) {
-      curr.push_back (prev[i]);
-      s += norm_score;
-      verbmsg ("ini: %d\tfin: %d\tscore: %d\tnorm_score: %lf\n", prev[i].ini, prev[i].fin, prev[i].score, ((double)prev[i].score) / ((double)(prev[i].fin-prev[i].ini)));
-    }
+  for (int j = 0; j < curr.size (); j++) {
+    Cost &c = curr[j];
+    double norm_score = ((double)c.score) / ((double)(c.fin-c.ini));
+    s += norm_score;
+    verbmsg ("ini: %d\tfin: %d\tscore: %d\tnorm_score: %lf\n", c.ini, c.fin, c.score, norm_score);
   }
   
   if (s) {
     s = s / curr.size();
-    rank.push_back (make_pair(id_song, s - ((curr.size() - 1)*0.15) ));
+    rank.push_back (make_pair(id_song, s - ((curr.size() - 1)*penalty) ));
   }
 }
 
+// normalized scores under 3, 0.15 of bonus per extra hit
+struct DtwHits {
+  static double max_norm () { return 3; }
+  static double penalty () { return 0.15; }
+};
+
+// any normalized score, 0.1 of bonus per extra hit
+struct UdsHits {
+  static double max_norm () { return HUGE_VAL; }
+  static double penalty () { return 0.1; }
+};
 
-void dp_matching (vector<int> seq, vector<int> r_seq, int id_song, vector<pair<int,double> > &rank)
+/**
+ * @brief Moves a DP row to the list of end cells.
+ */
+void keep_last_row (Scratch &sc, Row &row, int size)
 {
-  verbmsg ("%lu %lu\n", seq.size(), r_seq.size());
-  vector<Cost> prev, curr;
-  
-  // DP Matching Algorithm
-  for (int j = 0; j < r_seq.size (); j++)
-    prev.push_back (Cost (j, j, ((seq[0] == r_seq[j]) ? 0 : 4), 0));
+  sc.last.resize (size, Cost (0, 0, 0, 0));
+  for (int j = 0; j < size; j++)
+    sc.last[j] = Cost (row.ini[j], j, row.score[j], row.height[j]);
+}
+
+/**
+ * @brief Compares the last rows of the scalar and vectorized kernels.
+ *
+ * @param sc Scratch buffers, sc.hits holds the last row of the scalar kernel
+ *           and sc.last the one of the vectorized kernel.
+ */
+void check_rows (Scratch &sc)
+{
+  bool ok = (sc.hits.size () == sc.last.size ());
+  for (int j = 0; ok && j < sc.last.size (); j++)
+    ok = (sc.hits[j].ini == sc.last[j].ini && sc.hits[j].fin == sc.last[j].fin &&
+          sc.hits[j].score == sc.last[j].score);
+  __sync_fetch_and_add (&validated, 1);
+  if (!ok) __sync_fetch_and_add (&validate_errors, 1);
+}
+
+/**
+ * @brief Shows how many samples the vectorized kernels did not agree on, and
+ * how far the cascade has been from exact DTW.
+ */
+void print_validation ()
+{
+  if (validated > 0)
+    errmsg ("validation: %ld samples, %ld mismatches\n", validated, validate_errors);
+  if (cascaded > 0) {
+    long found = cascade_differ - cascade_missed;
+    errmsg ("cascade: %ld samples, %ld differ from exact dtw, %ld missed, mean error %lf\n",
+            cascaded, cascade_differ, cascade_missed, found ? cascade_error / 1e6 / found : 0.0);
+  }
+}
+
+/*
+ * Recurrences of the DP matchers.
+ *
+ * A step policy gives the local distance and the step rule of a grid: the
+ * cells of its first row, of its first column and of the rest of it. The row
+ * kernels are templates instantiated once per policy, so each one is compiled
+ * with its cells inlined in the loop and no test of the method inside.
+ */
+
+// cells of a DP row, as plain pointers for the inner loops
+struct Cells {
+  int *ini, *score, *height;
+  Cells (Row &r) : ini(&r.ini[0]), score(&r.score[0]), height(&r.height[0]) {}
+};
+
+// MIDI notes, paths chosen by the height they keep, that is, transposed
+struct DtwStep {
+  static void first (Cells c, int j, int note, int r)
+  {
+    c.ini[j] = j; c.score[j] = 0; c.height[j] = note - r;
+  }
+  static void column (Cells p, Cells c, int note, int r)
+  {
+    int dist_ij = note - r;
+    c.ini[0] = p.ini[0]; c.score[0] = p.score[0] + abs (p.height[0] - dist_ij); c.height[0] = p.height[0];
+  }
+  static void cell (Cells p, Cells c, int j, int note, int r)
+  {
+    int dist_ij = note - r;
+    int m = min_step (c.height[j-1], c.score[j-1], p.height[j], p.score[j], p.height[j-1], p.score[j-1], dist_ij);
+    if (m == 1) {
+      c.ini[j] = c.ini[j-1]; c.score[j] = c.score[j-1] + abs (c.height[j-1] - dist_ij); c.height[j] = c.height[j-1];
+    } else if (m == 2) {
+      c.ini[j] = p.ini[j]; c.score[j] = p.score[j] + abs (p.height[j] - dist_ij); c.height[j] = p.height[j];
+    } else {
+      c.ini[j] = p.ini[j-1]; c.score[j] = p.score[j-1] + abs (p.height[j-1] - dist_ij); c.height[j] = p.height[j-1];
+    }
+  }
+  static void simd_rows (const vector<int> &seq, const int *r_seq, int r_size, Scratch &sc, Pruning *pr)
+  {
+    dtw_simd_rows (seq, r_seq, r_size, sc, pr);
+  }
+};
+
+// UDS symbols, edit distance with weighted steps, heights are not used
+struct UdsStep {
+  static void first (Cells c, int j, int note, int r)
+  {
+    c.ini[j] = j; c.score[j] = ((note == r) ? 0 : 4); c.height[j] = 0;
+  }
+  static void column (Cells p, Cells c, int note, int r)
+  {
+    c.ini[0] = p.ini[0]; c.score[0] = p.score[0] + ((note == r) ? 0 : 4);
+  }
+  static void cell (Cells p, Cells c, int j, int note, int r)
+  {
+    int dist_ij = ((note == r) ? 0 : 2);
+    int s1 = c.score[j-1] + dist_ij/2, s2 = p.score[j] + dist_ij, s3 = p.score[j-1] + (3*dist_ij)/2;
+    int m = pos_min (s1, s2, s3);
+    if (m == 1) {
+      c.ini[j] = c.ini[j-1]; c.score[j] = s1;
+    } else if (m == 2) {
+      c.ini[j] = p.ini[j]; c.score[j] = s2;
+    } else {
+      c.ini[j] = p.ini[j-1]; c.score[j] = s3;
+    }
+  }
+  static void simd_rows (const vector<int> &seq, const int *r_seq, int r_size, Scratch &sc, Pruning *pr)
+  {
+    dp_simd_rows (seq, r_seq, r_size, sc, pr);
+  }
+};
+
+/**
+ * @brief First row of a grid, every reference note can start a path.
+ */
+template <class Step>
+void first_row (int note, const int *r_seq, int r_size, Row &row)
+{
+  row.resize (r_size);
+  Cells c (row);
+  for (int j = 0; j < r_size; j++)
+    Step::first (c, j, note, r_seq[j]);
+}
+
+/**
+ * @brief Computes the next row of a grid from the previous one.
+ *
+ * @param note Humming note of the new row.
+ * @param r_seq Reference sequence.
+ * @param r_size Length of the reference sequence.
+ * @param prev Previous row.
+ * @param curr Row to compute, already of size r_size.
+ */
+template <class Step>
+void next_row (int note, const int *r_seq, int r_size, Row &prev, Row &curr)
+{
+  Cells p (prev), c (curr);
+  Step::column (p, c, note, r_seq[0]);
+  for (int j = 1; j < r_size; j++)
+    Step::cell (p, c, j, note, r_seq[j]);
+}
+
+/**
+ * @brief Computes the recurrence of a grid row by row.
+ *
+ * Leaves in sc.last the last row of the grid of the humming against the
+ * reference, as <ini, fin, score, height> costs. Only two rows are kept, in
+ * the scratch buffers.
+ *
+ * @return true if the DP has been abandoned because it cannot reach the limit.
+ */
+template <class Step>
+bool dp_rows (const vector<int> &seq, const int *r_seq, int r_size, Scratch &sc, double limit, Pruning *pr)
+{
+  Row *prev = &sc.rows[0], *curr = &sc.rows[1];
+  first_row<Step> (seq[0], r_seq, r_size, *prev);
+  curr->resize (r_size);
+
   for (int i = 1; i < seq.size (); i++) {
-    curr.push_back (Cost (0, 0, prev[0].score + ((seq[i] == r_seq[0]) ? 0 : 4), 0));
-    for (int j = 1; j < r_seq.size (); j++) {
-      int dist_ij = ((seq[i] == r_seq[j]) ? 0 : 2);
-      int m = pos_min (curr[j-1].score + dist_ij/2,
-                   prev[j].score + dist_ij,
-                   prev[j-1].score + (3*dist_ij)/2);
-      if (m == 1) {
-        curr.push_back (Cost (curr[j-1].ini, j, curr[j-1].score + dist_ij/2, 0));
+    next_row<Step> (seq[i], r_seq, r_size, *prev, *curr);
+    swap (prev, curr);
+    if (pr != NULL && abandoned (&prev->score[0], r_size, i, seq.size (), limit, pr)) return true;
+  }
+  keep_last_row (sc, *prev, r_size);
+  return false;
+}
+
+/*
+ * Constrained DTW.
+ *
+ * A match is only accepted when its length is between p*|seq| and
+ * (3-p)*|seq|, that is, when the path advances between p and 3-p reference
+ * notes per humming note. The constrained recurrence keeps every path inside
+ * that slope, widened by band notes, from the very first row: a predecessor
+ * is only taken if the cell stays at a span j - ini between p*i - band and
+ * min ((3-p)*i + band, (3-p)*|seq|). Cells without such a predecessor are
+ * dead, and the cells left of p*i - band, which no start can reach, are not
+ * computed at all.
+ *
+ * Every reference note starts a path of its own, so right of p*i - band some
+ * predecessor is nearly always in the band and dead cells are rare: the band
+ * is a constraint on the matches, not a speedup, and costs about as much per
+ * cell as dtw.
+ */
+#define DEAD_CELL INT_MAX
+// start of a dead cell, so that its span is never in the band
+#define DEAD_INI (INT_MAX / 2)
+
+bool in_band (int span, int lo, int hi)
+{
+  // one comparison, a span under lo wraps over hi - lo
+  return (unsigned) (span - lo) <= (unsigned) (hi - lo);
+}
+
+/**
+ * @brief Chooses the predecessor of a cell of the band.
+ *
+ * Dead predecessors are never chosen. When the three are alive the choice is
+ * the one of min_dist, as in dtw, otherwise it is the live one with the
+ * lowest height distance, then the lowest score.
+ *
+ * @param a Height distance of each predecessor, DEAD_CELL if dead.
+ * @param s Score of each predecessor.
+ * @return 1, 2 or 3 as min_dist, 0 if every predecessor is dead.
+ */
+int band_step (const int *a, const int *s)
+{
+  if (a[0] != DEAD_CELL && a[1] != DEAD_CELL && a[2] != DEAD_CELL)
+    return min_dist (a[0], s[0], a[1], s[1], a[2], s[2]);
+  int m = 0;
+  for (int k = 0; k < 3; k++)
+    if (a[k] != DEAD_CELL && (m == 0 || a[k] < a[m-1] || (a[k] == a[m-1] && s[k] < s[m-1])))
+      m = k + 1;
+  return m;
+}
+
+/**
+ * @brief Computes the constrained DTW recurrence row by row.
+ *
+ * Same as dp_rows<DtwStep>, restricted to the band. Dead end cells are left out of
+ * sc.last.
+ *
+ * @return true if the DP has been abandoned because it cannot reach the limit.
+ */
+bool cdtw_rows (const vector<int> &seq, const int *r_seq, int r_size, Scratch &sc, double limit, Pruning *pr)
+{
+  Row *prev = &sc.rows[0], *curr = &sc.rows[1];
+  double p = 0.6;
+  int n = seq.size ();
+  prev->resize (r_size);
+  curr->resize (r_size);
+
+  for (int j = 0; j < r_size; j++) {
+    prev->ini[j] = j;
+    prev->score[j] = 0;
+    prev->height[j] = seq[0] - r_seq[j];
+  }
+  for (int i = 1; i < n; i++) {
+    int *pi = &prev->ini[0], *ps = &prev->score[0], *ph = &prev->height[0];
+    int *ci = &curr->ini[0], *cs = &curr->score[0], *ch = &curr->height[0];
+    // spans are whole notes, so the band is checked on integers
+    int lo = (int) ceil (p*i - band), hi = (int) floor (min ((3-p)*i + band, (3-p)*n));
+    int first = max (0, lo);
+    for (int j = 0; j < first && j < r_size; j++) {
+      ci[j] = DEAD_INI;
+      cs[j] = DEAD_CELL;
+    }
+    for (int j = first; j < r_size; j++) {
+      int dist_ij = (seq[i] - r_seq[j]);
+      int m;
+      // a dead predecessor has a start out of the band
+      bool left = j > 0 && in_band (j - ci[j-1], lo, hi);
+      bool up = in_band (j - pi[j], lo, hi);
+      bool diag = j > 0 && in_band (j - pi[j-1], lo, hi);
+      if (left && up && diag) {
+        m = min_step (ch[j-1], cs[j-1], ph[j], ps[j], ph[j-1], ps[j-1], dist_ij);
+      } else {
+        // height distance and score of each admissible predecessor
+        int a[3] = { DEAD_CELL, DEAD_CELL, DEAD_CELL }, s[3] = { 0, 0, 0 };
+        if (left) { a[0] = abs (ch[j-1] - dist_ij); s[0] = cs[j-1]; }
+        if (up) { a[1] = abs (ph[j] - dist_ij); s[1] = ps[j]; }
+        if (diag) { a[2] = abs (ph[j-1] - dist_ij); s[2] = ps[j-1]; }
+        m = band_step (a, s);
+      }
+      if (m == 0) {
+        ci[j] = DEAD_INI; cs[j] = DEAD_CELL;
+      } else if (m == 1) {
+        ci[j] = ci[j-1]; cs[j] = cs[j-1] + abs (ch[j-1] - dist_ij); ch[j] = ch[j-1];
       } else if (m == 2) {
-        curr.push_back (Cost (prev[j].ini, j, prev[j].score + dist_ij, 0));
+        ci[j] = pi[j]; cs[j] = ps[j] + abs (ph[j] - dist_ij); ch[j] = ph[j];
       } else {
-        curr.push_back (Cost (prev[j-1].ini, j, prev[j-1].score + (3*dist_ij)/2, 0));
+        ci[j] = pi[j-1]; cs[j] = ps[j-1] + abs (ph[j-1] - dist_ij); ch[j] = ph[j-1];
       }
     }
-    prev.swap (curr);
-    curr.clear ();
+    swap (prev, curr);
+    if (pr != NULL) pr->cells -= min (first, r_size);
+    if (pr != NULL && abandoned (&prev->score[0], r_size, i, n, limit, pr)) return true;
   }
-  
-  // Transfor the result <(ini, score), fin> in <ini, fin> ordered ascending by score
-  sort (prev.begin (), prev.end ());
-  
-  double s = 0.0;
+
+  sc.last.clear ();
+  for (int j = 0; j < r_size; j++)
+    if (prev->score[j] != DEAD_CELL)
+      sc.last.push_back (Cost (prev->ini[j], j, prev->score[j], prev->height[j]));
+  return false;
+}
+
+/*
+ * Coarse-to-fine DTW.
+ *
+ * The query and the reference are reduced to the mean of every paa notes
+ * (piecewise aggregate approximation) and matched by DTW, which costs paa^2
+ * times less. The best regions of the reduced last row are projected back to
+ * the reference, widened by one query length, and only those windows are
+ * matched at full resolution. Paths are chosen by height and not by score,
+ * so a window may end in a different match than the whole reference does;
+ * -c reports how often that happens.
+ */
+#define CASCADE_REGIONS 3
+
+/**
+ * @brief Reduces a sequence to the means of its segments of paa values.
+ */
+void reduce_paa (const int *seq, int size, int factor, vector<int> &out)
+{
+  out.clear ();
+  for (int i = 0; i < size; i += factor) {
+    int n = min (factor, size - i), sum = 0;
+    for (int k = 0; k < n; k++) sum += seq[i + k];
+    out.push_back ((sum + n / 2) / n);
+  }
+}
+
+bool dtw_kernel (const vector<int> &seq, const int *r_seq, int r_size, Scratch &sc, double limit, Pruning *pr)
+{
+  if (simd) {
+    dtw_simd_rows (seq, r_seq, r_size, sc, pr);
+    return false;
+  }
+  return dp_rows<DtwStep> (seq, r_seq, r_size, sc, limit, pr);
+}
+
+/**
+ * @brief Computes the last row of the cascade.
+ *
+ * Leaves in sc.last the end cells found at full resolution inside the
+ * windows projected from the best coarse regions, with positions of the
+ * whole reference.
+ *
+ * @return true if every window has been abandoned.
+ */
+bool cascade_rows (const vector<int> &seq, const int *r_seq, int r_size, Scratch &sc, double limit, Pruning *pr)
+{
   double p = 0.6;
+  int n = seq.size ();
+  reduce_paa (&seq[0], n, paa, sc.coarse);
+  reduce_paa (r_seq, r_size, paa, sc.r_coarse);
+  int nc = sc.coarse.size ();
+
+  // coarse pass, never abandoned since its scores are not comparable
+  dtw_kernel (sc.coarse, &sc.r_coarse[0], sc.r_coarse.size (), sc, HUGE_VAL, pr);
+
+  // best regions of admissible length, a coarse cell of slack on each side,
+  // and never empty since take_hits compares score / len
+  vector<Cost> &prev = sc.last;
+  int k = 0;
   for (int i = 0; i < prev.size (); i++) {
-    //verbmsg ("ini: %d\tfin: %d\tscore: %d\n", prev[i].ini, prev[i].fin, prev[i].score);
-    bool ok = true;
-    for (int j = 0; j < curr.size (); j++) {
-      if ((prev[i].ini >= curr[j].ini && prev[i].ini <= curr[j].fin) ||
-          (prev[i].fin >= curr[j].ini && prev[i].fin <= curr[j].fin)) {
-        ok = false;
-      }
+    double len = prev[i].fin - prev[i].ini;
+    if (len >= 1 && len > p*nc - 1 && len < (3-p)*nc + 1) prev[k++] = prev[i];
+  }
+  prev.erase (prev.begin () + k, prev.end ());
+  take_hits (prev, CASCADE_REGIONS, sc.hits);
+
+  // refine the projected windows, in reference order
+  int margin = max (2 * paa, n);
+  sc.found.clear ();
+  bool all_abandoned = true;
+  for (int j = 0; j < sc.hits.size (); j++) {
+    int first = max (0, sc.hits[j].ini * paa - margin);
+    int last = min (r_size, (sc.hits[j].fin + 1) * paa + margin);
+    // overlapping windows are matched once
+    while (j + 1 < sc.hits.size () && sc.hits[j+1].ini * paa - margin < last)
+      last = min (r_size, (sc.hits[++j].fin + 1) * paa + margin);
+    if (dtw_kernel (seq, r_seq + first, last - first, sc, limit, pr)) continue;
+    all_abandoned = false;
+    for (int i = 0; i < sc.last.size (); i++) {
+      Cost c = sc.last[i];
+      c.ini += first;
+      c.fin += first;
+      sc.found.push_back (c);
+    }
+  }
+  swap (sc.last, sc.found);
+  return all_abandoned && !sc.hits.empty ();
+}
+
+/**
+ * @brief Compares the cascade with exact DTW on a reference.
+ *
+ * @param sim Similarity found by the cascade, 0 if none.
+ */
+void check_cascade (const vector<int> &seq, const int *r_seq, int r_size, double sim, Scratch &sc)
+{
+  vector<pair<int,double> > exact;
+  dp_rows<DtwStep> (seq, r_seq, r_size, sc, HUGE_VAL, NULL);
+  select_hits (sc, seq.size (), DtwHits::max_norm (), DtwHits::penalty (), 0, exact);
+  double e = exact.empty () ? 0 : exact[0].second;
+
+  __sync_fetch_and_add (&cascaded, 1);
+  if (e == sim) return;
+  __sync_fetch_and_add (&cascade_differ, 1);
+  if (sim == 0) __sync_fetch_and_add (&cascade_missed, 1);
+  else if (e != 0) __sync_fetch_and_add (&cascade_error, (long) (fabs (sim - e) * 1e6));
+}
+
+/*
+ * Matching engine.
+ *
+ * match_sample is instantiated once per method with three policies: the
+ * encoding of the sequences, the kernel that computes the end cells and the
+ * selection of the hits. The methods are listed in a table that is searched
+ * by name once, by the caller of a whole scan, and only the matcher found
+ * is called for each sample.
+ */
+
+// MIDI notes, bounded by their pitch intervals
+struct MidiEncoding {
+  static void convert (FILE *stream, vector<int> &seq) { convert_to_MIDI (stream, seq); }
+  static int lower_bound (const vector<int> &seq, const int *r_seq, int r_size)
+  {
+    return pitch_lower_bound (seq, r_seq, r_size);
+  }
+};
+
+// UDS symbols, without a lower bound
+struct UdsEncoding {
+  static void convert (FILE *stream, vector<int> &seq) { convert_to_UDS (stream, seq); }
+  static int lower_bound (const vector<int> &seq, const int *r_seq, int r_size) { return 0; }
+};
+
+// whole grid, by rows or vectorized along anti-diagonals
+template <class Step>
+struct ExactKernel {
+  static bool rows (const vector<int> &seq, const int *r_seq, int r_size, Scratch &sc, double limit, Pruning *pr)
+  {
+    if (validate) {
+      dp_rows<Step> (seq, r_seq, r_size, sc, HUGE_VAL, NULL);
+      swap (sc.last, sc.hits);
+      Step::simd_rows (seq, r_seq, r_size, sc, pr);
+      check_rows (sc);
+      return false;
     }
-    double norm_score = ((double)prev[i].score) / ((double)(prev[i].fin-prev[i].ini));
-    if (ok && (/*norm_score < 0.35 && */((double)(prev[i].fin-prev[i].ini)) > p*seq.size() && ((double)(prev[i].fin-prev[i].ini)) < (3-p)*seq.size()) && curr.size() < 1) {
-      curr.push_back (prev[i]);
-      s += norm_score;
-      verbmsg ("ini: %d\tfin: %d\tscore: %d\tnorm_score: %lf\n", prev[i].ini, prev[i].fin, prev[i].score, ((double)prev[i].score) / ((double)(prev[i].fin-prev[i].ini)));
+    if (simd) {
+      Step::simd_rows (seq, r_seq, r_size, sc, pr);
+      return false;
     }
+    return dp_rows<Step> (seq, r_seq, r_size, sc, limit, pr);
   }
+  static void check (const vector<int> &seq, const int *r_seq, int r_size, double sim, Scratch &sc) {}
+};
+
+struct BandKernel {
+  static bool rows (const vector<int> &seq, const int *r_seq, int r_size, Scratch &sc, double limit, Pruning *pr)
+  {
+    return cdtw_rows (seq, r_seq, r_size, sc, limit, pr);
+  }
+  static void check (const vector<int> &seq, const int *r_seq, int r_size, double sim, Scratch &sc) {}
+};
+
+struct CascadeKernel {
+  static bool rows (const vector<int> &seq, const int *r_seq, int r_size, Scratch &sc, double limit, Pruning *pr)
+  {
+    return cascade_rows (seq, r_seq, r_size, sc, limit, pr);
+  }
+  static void check (const vector<int> &seq, const int *r_seq, int r_size, double sim, Scratch &sc)
+  {
+    if (validate) check_cascade (seq, r_seq, r_size, sim, sc);
+  }
+};
+
+/**
+ * @brief Matches a query against a reference and adds the song to the rank.
+ *
+ * @param seq Converted humming sequence.
+ * @param r_seq Reference sequence.
+ * @param r_size Length of the reference sequence.
+ * @param id_song Identifier of the song.
+ * @param rank Rank list where the <song, similarity> pairs are stored.
+ * @param pr Pruning state, NULL to match the reference completely.
+ * @param sc Scratch buffers of the thread.
+ */
+template <class Encoding, class Kernel, class Hits>
+void match_sample (const vector<int> &seq, const int *r_seq, int r_size, int id_song, vector<pair<int,double> > &rank, Pruning *pr, Scratch &sc)
+{
+  verbmsg ("%lu %d\n", seq.size(), r_size);
+  // a similarity must be under the limit to reach the rank
+  double limit = Hits::max_norm ();
   
-  if (s) {
-    s = s / curr.size();
-    rank.push_back (make_pair(id_song, s - ((curr.size() - 1)*0.1) ));
+  if (pr != NULL) {
+    pr->samples++;
+    // the bonus of the extra hits may bring a song under the threshold
+    limit = min (limit, pr->threshold + (max_hits - 1) * Hits::penalty ());
+    if (pruned (Encoding::lower_bound (seq, r_seq, r_size), seq.size (), limit)) {
+      pr->samples_pruned++;
+      pr->cells_pruned += (long) seq.size () * r_size;
+      return;
+    }
   }
+  
+  int n = rank.size ();
+  if (!Kernel::rows (seq, r_seq, r_size, sc, limit, pr))
+    select_hits (sc, seq.size (), Hits::max_norm (), Hits::penalty (), id_song, rank);
+  
+  Kernel::check (seq, r_seq, r_size, (rank.size () > n) ? rank.back ().second : 0, sc);
 }
 
+const MatchingMethod matching_methods[] = {
+  { "uds",     UdsEncoding::convert,  match_sample<UdsEncoding, ExactKernel<UdsStep>, UdsHits> },
+  { "dtw",     MidiEncoding::convert, match_sample<MidiEncoding, ExactKernel<DtwStep>, DtwHits> },
+  { "cdtw",    MidiEncoding::convert, match_sample<MidiEncoding, BandKernel, DtwHits> },
+  { "cascade", MidiEncoding::convert, match_sample<MidiEncoding, CascadeKernel, DtwHits> },
+};
+
+/**
+ * @brief Looks up a matching method by name.
+ *
+ * @return The method, or NULL if there is no method with that name.
+ */
+const MatchingMethod *find_method (const char *name)
+{
+  for (int k = 0; k < sizeof (matching_methods) / sizeof (matching_methods[0]); k++)
+    if (strcmp (matching_methods[k].name, name) == 0) return &matching_methods[k];
+  return NULL;
+}
 
 // main process
-void matching (vector<int> seq, vector<int> r_seq, int id_song, vector<pair<int,double> > &rank)
+void matching (const vector<int> &seq, const int *r_seq, int r_size, int id_song, vector<pair<int,double> > &rank, Pruning *pr, Scratch &sc)
 {
-  if (strcmp (matching_method, "uds") == 0)
-    dp_matching (seq, r_seq, id_song, rank);
-  else if (strcmp (matching_method, "dtw") == 0)
-    dtw_matching (seq, r_seq, id_song, rank);
-    
-}
\ No newline at end of file
+  const MatchingMethod *method = find_method (matching_method);
+  if (method != NULL) method->match (seq, r_seq, r_size, id_song, rank, pr, sc);
+}
+
+void matching (const vector<int> &seq, const int *r_seq, int r_size, int id_song, vector<pair<int,double> > &rank)
+{
+  Scratch sc;
+  matching (seq, r_seq, r_size, id_song, rank, NULL, sc);
+}